@@ -0,0 +1,31 @@
+#!/bin/sh
+# bench_wmctl.sh - comandos/s do wmctl.sh (socat) contra o wmctl nativo
+# Uso: sh bench_wmctl.sh [N]   (precisa do WM rodando; usa "ping", que não altera estado)
+#
+#   wmctl.sh     um fork+exec de sh e de socat e um connect por comando
+#   wmctl        um exec e um connect por comando
+#   wmctl -      N comandos em pipeline numa única conexão
+
+N="${1:-2000}"
+DIR="$(dirname "$0")"
+WMCTL="${WMCTL:-$DIR/wmctl}"
+
+now() { date +%s.%N; }
+rate() { echo "$1 $2 $3" | awk '{ printf "%10.0f cmd/s\n", $1 / ($3 - $2) }'; }
+
+run() {
+  name="$1"; shift
+  t0=$(now)
+  "$@"
+  t1=$(now)
+  printf "%-22s" "$name"; rate "$N" "$t0" "$t1"
+}
+
+loop() { i=0; while [ "$i" -lt "$N" ]; do "$@" ping >/dev/null || exit 1; i=$((i + 1)); done; }
+pipelined() { yes ping | head -n "$N" | "$WMCTL" - >/dev/null; }
+
+"$WMCTL" ping >/dev/null || { echo "bench_wmctl: WM não responde" >&2; exit 1; }
+echo "$N comandos cada:"
+command -v socat >/dev/null && run "wmctl.sh (socat)" loop sh "$DIR/wmctl.sh"
+run "wmctl (nativo)" loop "$WMCTL"
+run "wmctl - (pipeline)" pipelined
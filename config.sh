@@ -46,9 +46,22 @@ done
 w rule "class=Firefox" "workspace=2"
 # Gimp sempre em floating
 w rule "class=Gimp" "float=true"
+# mpv: roda a macro "media" quando a janela abre
+w rule "class=mpv" "macro=media"
 # Terminal scratchpad
 w scratch "term:st"
 
+### Macros ###
+# vários comandos num passo só: executados juntos no WM, com um único relayout
+# (presets de "layout load" só existem depois de um "layout save <nome>" na sessão)
+w macro media "view 4; set-layout bsp 4"
+w bind "Mod4-m" "run media"
+
+### Hooks ###
+# hook <map|unmap|focus|workspace> [predicados...] do <cmd>; <cmd>
+# rodam dentro do WM; o que for lançado com spawn recebe HWM_WIN, HWM_CLASS, HWM_TITLE, HWM_WS
+w hook map "class=mpv" "workspace=4" do "spawn notify-send mpv \"\$HWM_TITLE\""
+
 ### Aparência ###
 w set-gap 10
 w set-border inner 3
@@ -59,6 +72,17 @@ w set-color outer "#88ccff"
 ### Barra ###
 # mostrar só workspaces ocupados
 w bar show-occupied-only true
+# linha do lemonbar renderizada pelo WM ({workspaces}, {title}, {layout})
+w bar format "%{l}{workspaces} %{c}{title} %{r}MyWM"
+w bar color-active "#88ccff"
+w bar color-occupied "#aaaaaa"
+w bar color-empty "#444444"
+w bar title-max 80
+# barra nativa desenhada pelo próprio WM (dispensa o mybar.sh/lemonbar)
+# w bar native true
+# w bar colors "#ffffff" "#222222"
+# agrupa eventos da barra: no máximo um por tópico a cada 16 ms
+w bar coalesce-ms 16
 # toggle bar
 w bind "Mod4-b" "togglebar"
 
@@ -5,7 +5,9 @@
 // - Designed so all substantive functions are declared and documented; implementers
 //   can fill in function bodies later and know exactly what each function must do.
 //
-// Build (example): g++ mywm_skeleton.cpp -o mywm -lxcb -lpthread -lstdc++fs
+// Build (example): g++ mywm_skeleton.cpp hibriwm_client.cpp -o mywm -lxcb -lxcb-randr -lpthread -lstdc++fs -ldl
+//   add -DHIBRIWM_TRACE for the `trace start|stop` span recorder (see Tracing)
+//   add -DNDEBUG for release builds: a round trip in a hot operation is then only counted (see XConnection::Op)
 // NOTE: This file is a single compilation unit that sketches all modules. Many
 // helper functions are left as TODO for clarity. Use this as the authoritative
 // reference for function names, parameters, and expected behavior.
@@ -13,25 +15,53 @@
 #include <xcb/xcb.h>
 #include <xcb/xproto.h>
 #include <xcb/xcb_event.h>
+#include <xcb/randr.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <poll.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <thread>
 #include <mutex>
 #include <shared_mutex>
 #include <condition_variable>
+#include <future>
 #include <string>
 #include <vector>
 #include <map>
+#include <array>
+#include <set>
+#include <unordered_set>
+#include <memory>
+#include <algorithm>
+#include <cmath>
 #include <optional>
 #include <queue>
+#include <deque>
 #include <atomic>
 #include <iostream>
 #include <sstream>
 #include <functional>
 #include <filesystem>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <climits>
+#include <cassert>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <pthread.h>
+#include "hibriwm_layout.h"
+#include "hibriwm_state.h"
+#include "hibriwm_ring.h"
+#include "hibriwm_flight.h"
+#include "hibriwm_client.h"
 #include <nlohmann/json.hpp> // requires nlohmann/json single-header, used for event payloads
 
 using json = nlohmann::json;
@@ -40,7 +70,7 @@ namespace fs = std::filesystem;
 // -----------------------------
 // Configuration constants
 // -----------------------------
-static const char *SOCK_PATH = "/tmp/mywm.sock"; // runtime socket
+// runtime socket: ${XDG_RUNTIME_DIR:-/tmp}/mywm.sock, shared with wmctl via hwm_socket_path()
 static const char *CONFIG_PATH = "/home/user/.config/mywm/config.sh"; // example
 
 // -----------------------------
@@ -48,23 +78,176 @@ static const char *CONFIG_PATH = "/home/user/.config/mywm/config.sh"; // example
 // -----------------------------
 using WindowID = uint32_t;
 struct Geometry { int x,y,w,h; };
+struct SizeHints { int min_w = 0, min_h = 0, max_w = 0, max_h = 0; }; // 0 = unset
 
 enum BorderType { INNER_BORDER, OUTER_BORDER };
 
 // Event types sent to bar/clients
 struct WmEvent {
-    std::string type; // e.g., "workspace", "focus", "bar-toggle"
+    std::string type; // e.g., "workspace", "focus", "bar-toggle", "layout"
     json payload;
+    std::string topic; // last-value cache key when one type has several topics ("layout:<monitor>"); defaults to type
 };
 
 // -----------------------------
 // Utility functions
 // -----------------------------
+static uint32_t color_pixel(const std::string &hex) {
+    // TrueColor visuals only: #rrggbb maps straight to the pixel value
+    return hex.size() == 7 && hex[0] == '#' ? (uint32_t)strtoul(hex.c_str() + 1, nullptr, 16) : 0;
+}
 static std::string hex_color_sanitize(const std::string &c) {
     // TODO: validate/normalize colors (#rrggbb) and return a canonical form
     return c;
 }
 
+// Sends `msg` with the given file descriptors attached (SCM_RIGHTS) over a UNIX socket
+static bool send_fds(int sock, const std::string &msg, const std::vector<int> &fds) {
+    std::vector<char> ctrl(CMSG_SPACE(sizeof(int) * fds.size()), 0);
+    iovec iov{(void*)msg.data(), msg.size()};
+    msghdr mh{}; mh.msg_iov = &iov; mh.msg_iovlen = 1;
+    mh.msg_control = ctrl.data(); mh.msg_controllen = ctrl.size();
+    cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET; cm->cmsg_type = SCM_RIGHTS; cm->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cm), fds.data(), sizeof(int) * fds.size());
+    return sendmsg(sock, &mh, MSG_NOSIGNAL) == (ssize_t)msg.size();
+}
+
+// Creates a sealed-size memfd of `size` bytes mapped read/write; returns the fd or -1
+static int create_shm(const char *name, size_t size, void **map) {
+    int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) return -1;
+    if (ftruncate(fd, size) != 0) { close(fd); return -1; }
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+    *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (*map == MAP_FAILED) { close(fd); *map = nullptr; return -1; }
+    return fd;
+}
+
+// Buffers output for a socket and writes it in CHUNK-sized pieces, so a large document is
+// never held in memory as a whole. Writes block (the caller is never the main loop).
+class ChunkWriter {
+public:
+    static constexpr size_t CHUNK = 16 * 1024;
+    explicit ChunkWriter(int fd) : fd_(fd) { buf_.reserve(CHUNK * 2); }
+    ChunkWriter &operator<<(const std::string &s) { buf_ += s; if (buf_.size() >= CHUNK) flush(); return *this; }
+    ChunkWriter &operator<<(const char *s) { return *this << std::string(s); }
+    bool flush() {
+        for (size_t off = 0; ok_ && off < buf_.size();) {
+            ssize_t w = send(fd_, buf_.data() + off, buf_.size() - off, MSG_NOSIGNAL);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) ok_ = false; else off += w;
+        }
+        buf_.clear();
+        return ok_;
+    }
+    bool ok() const { return ok_; } // false once the peer went away: stop producing
+
+private:
+    int fd_;
+    bool ok_ = true;
+    std::string buf_;
+};
+
+// Reopens a memfd read-only, so clients handed the fd cannot write into the mapping
+static int reopen_readonly(int fd) {
+    std::string path = "/proc/self/fd/" + std::to_string(fd);
+    return open(path.c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+// Gather-send on a socket until everything is out: resumes after short writes and sends at
+// most IOV_MAX entries per call; sent bytes are consumed from `iov`. False once the peer is
+// gone (no SIGPIPE). With MSG_DONTWAIT in `flags` it also returns (true) when the socket
+// buffer is full, leaving the unsent rest in `iov`.
+static bool send_iov(int sock, std::vector<iovec> &iov, int flags = 0) {
+    size_t i = 0;
+    for (;;) {
+        while (i < iov.size() && !iov[i].iov_len) i++;
+        if (i == iov.size()) return true;
+        msghdr msg{};
+        msg.msg_iov = iov.data() + i; msg.msg_iovlen = std::min<size_t>(iov.size() - i, IOV_MAX);
+        ssize_t w = sendmsg(sock, &msg, MSG_NOSIGNAL | flags);
+        if (w < 0 && errno == EINTR) continue;
+        if (w < 0 && (flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK)) return true;
+        if (w <= 0) return false;
+        for (size_t n = w; n;) {
+            size_t k = std::min(n, iov[i].iov_len);
+            iov[i].iov_base = (char*)iov[i].iov_base + k; iov[i].iov_len -= k; n -= k;
+            if (!iov[i].iov_len) i++;
+        }
+    }
+}
+
+// -----------------------------
+// Latency histogram (log-linear buckets, lock-free recording)
+// -----------------------------
+// Values below SUB get a bucket each; above, every power of two is split into SUB linear
+// buckets, so a bucket is never wider than 1/SUB of its values (HDR-style) and the whole
+// 64-bit range fits in ~1k counters. record() is a handful of relaxed atomic ops.
+class Histogram {
+public:
+    static constexpr int SUB_BITS = 4, SUB = 1 << SUB_BITS;
+    static constexpr size_t BUCKETS = (64 - SUB_BITS + 1) * SUB;
+    void record(uint64_t v);
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+    uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+    uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+    uint64_t quantile(double q) const; // upper bound of the bucket holding the q-quantile
+    json summary() const;              // {count, sum, max, p50, p90, p99, p999}
+
+private:
+    static size_t bucket(uint64_t v);
+    static uint64_t bucket_upper(size_t b);
+    std::atomic<uint64_t> buckets_[BUCKETS] = {};
+    std::atomic<uint64_t> count_{0}, sum_{0}, max_{0};
+};
+
+// -----------------------------
+// Metrics registry (`query metrics`, JSON or Prometheus text)
+// -----------------------------
+// Metrics are registered once, by whoever owns them, and never go away: the returned
+// references stay valid and are updated with relaxed atomics from any thread. Only
+// registration and export take the registry mutex. Histograms hold microseconds.
+class Metrics {
+public:
+    struct Counter {
+        std::atomic<uint64_t> v{0};
+        void add(uint64_t n = 1) { v.fetch_add(n, std::memory_order_relaxed); }
+        uint64_t get() const { return v.load(std::memory_order_relaxed); }
+    };
+    struct Gauge {
+        std::atomic<int64_t> v{0};
+        void set(int64_t x) { v.store(x, std::memory_order_relaxed); }
+        void add(int64_t n) { v.fetch_add(n, std::memory_order_relaxed); }
+        int64_t get() const { return v.load(std::memory_order_relaxed); }
+    };
+    using Sampler = std::function<double()>; // value computed at export time
+
+    // `labels` is a Prometheus label set without braces (`type="MapRequest"`). Registering
+    // an existing name + labels returns the metric already there.
+    Counter &counter(const std::string &name, const std::string &help, const std::string &labels = "");
+    Gauge &gauge(const std::string &name, const std::string &help, const std::string &labels = "");
+    Histogram &histogram(const std::string &name, const std::string &help, const std::string &labels = "");
+    void sampled(const std::string &name, const std::string &help, const std::string &labels, Sampler fn,
+                 bool monotonic = false); // monotonic: exported as a counter
+    void attach(const std::string &name, const std::string &help, const std::string &labels, const Histogram &h); // owned elsewhere
+
+    json to_json() const;
+    std::string to_prometheus() const; // text exposition, ends with "# EOF"
+
+private:
+    enum Kind { COUNTER, GAUGE, SAMPLED, SAMPLED_COUNTER, HISTOGRAM };
+    struct Entry { std::string name, help, labels; Kind kind; const void *metric; Sampler fn; };
+    mutable std::mutex mtx_;
+    std::deque<Counter> counters_; // deques: registration never moves existing metrics
+    std::deque<Gauge> gauges_;
+    std::deque<Histogram> histograms_;
+    std::vector<Entry> entries_;
+
+    const Entry *find(const std::string &name, const std::string &labels) const; // caller holds mtx_
+};
+Metrics &metrics(); // the process-wide registry
+
 // -----------------------------
 // X Connection wrapper
 // -----------------------------
@@ -80,6 +263,7 @@ public:
     // Accessors
     xcb_connection_t* conn() { return conn_; }
     int screen_number() const { return screen_num_; }
+    xcb_screen_t* screen() const { return screen_; }
 
     // Event helpers
     xcb_window_t root() const { return root_; }
@@ -91,14 +275,154 @@ public:
     // send simple client messages or EWMH updates (helpers)
     void set_wm_name(const std::string &name);
 
+    // Properties (each uncached call is one round-trip)
+    xcb_atom_t atom(const std::string &name); // interned once, cached afterwards
+    void intern(const std::vector<std::string> &names); // caches all of them in one round trip
+    std::optional<uint32_t> get_cardinal(xcb_window_t w, xcb_atom_t prop);
+    std::string get_text(xcb_window_t w, xcb_atom_t prop); // STRING/UTF8_STRING, "" if unset
+    // The same split in two, to read several properties in one round trip: send every
+    // request_*, call round_trip() once, then collect each *_reply
+    xcb_get_property_cookie_t request_cardinal(xcb_window_t w, xcb_atom_t prop);
+    xcb_get_property_cookie_t request_text(xcb_window_t w, xcb_atom_t prop);
+    xcb_get_property_cookie_t request_size_hints(xcb_window_t w); // WM_NORMAL_HINTS min/max size
+    std::optional<uint32_t> cardinal_reply(xcb_get_property_cookie_t ck);
+    std::string text_reply(xcb_get_property_cookie_t ck);
+    SizeHints size_hints_reply(xcb_get_property_cookie_t ck);
+    std::vector<Geometry> outputs(); // active RandR monitors, primary first; empty without RandR 1.5
+
+    // Request accounting: every request cookie passes through sent(), every blocking wait
+    // for a reply is announced with round_trip(); both are exported as metrics
+    template<class Cookie> Cookie sent(Cookie c) {
+        requests_.add();
+        if (op_.stats) op_.stats->requests->add();
+        last_seq_.store(c.sequence, std::memory_order_relaxed);
+        return c;
+    }
+    void round_trip();
+    unsigned last_sequence() const { return last_seq_.load(std::memory_order_relaxed); }
+
+private:
+    struct OpStats { Metrics::Counter *requests, *round_trips, *hot_round_trips; };
+    struct OpState { OpStats *stats; const char *name; bool hot; };
+
+public:
+    // Operation scope (main loop): requests and round trips issued while it is alive are
+    // also counted under its name (hibriwm_x_op_*{op="..."}); the innermost scope gets them.
+    // A HOT scope, and everything nested in it, must never wait for a reply: a round trip
+    // there is counted as a violation (hibriwm_x_hot_round_trips_total), logged and, in
+    // debug builds (no -DNDEBUG), asserts. A WAITS scope is the whitelist: the few paths
+    // that must wait (creating the native bar, loading the keymap) even when a hot scope runs them.
+    class Op {
+    public:
+        enum Kind { NORMAL, HOT, WAITS };
+        Op(XConnection &xc, const char *name, Kind kind = NORMAL);
+        ~Op() { xc_.op_ = prev_; }
+        Op(const Op&) = delete;
+        Op &operator=(const Op&) = delete;
+    private:
+        XConnection &xc_;
+        OpState prev_;
+    };
+
 private:
+    OpState op_{nullptr, nullptr, false};
+    std::map<const char*, OpStats> ops_; // by name literal
+    OpStats &op_stats(const char *name);
+    Metrics::Counter &requests_ = metrics().counter("hibriwm_x_requests_total", "X requests sent");
+    Metrics::Counter &round_trips_ = metrics().counter("hibriwm_x_round_trips_total", "Blocking waits for an X reply");
+    std::atomic<unsigned> last_seq_{0};
     xcb_connection_t *conn_ = nullptr;
     const xcb_setup_t *setup_ = nullptr;
     xcb_screen_t *screen_ = nullptr;
     int screen_num_ = 0;
     xcb_window_t root_ = 0;
+    std::map<std::string, xcb_atom_t> atoms_;
+};
+
+// -----------------------------
+// Tracing: spans of the event pipeline, dumped as Chrome trace JSON (-DHIBRIWM_TRACE)
+// -----------------------------
+// `trace start [file]` ... `trace stop [file]` writes the spans recorded in between; open
+// it in ui.perfetto.dev or chrome://tracing. Every thread records into its own ring (one
+// writer, seqlock slots as in hibriwm_ring.h), so a span costs two clock reads and a copy
+// while tracing and a relaxed load otherwise. Spans carry the X sequence number at their
+// start and end, and the "#<id>" of the IPC command they ran for. Without HIBRIWM_TRACE
+// the macros compile to nothing and the `trace` command does not exist.
+#ifdef HIBRIWM_TRACE
+class Tracer {
+public:
+    static Tracer &get();
+    void set_connection(const XConnection *xc) { xc_ = xc; }
+    bool start(const std::string &path); // "" = ${XDG_RUNTIME_DIR:-/tmp}/hibriwm-trace.json
+    bool stop(const std::string &path);  // "" = the path given to start(); written on a helper thread
+    bool active() const { return active_.load(std::memory_order_relaxed); }
+    void name_thread(const std::string &name);
+    void record(const char *name, const std::string &detail, uint64_t t0, uint32_t xseq0);
+    unsigned xseq() const { return xc_ ? xc_->last_sequence() : 0; }
+    static uint64_t now_ns();
+    static thread_local uint64_t current_cmd; // IPC request id of the command this thread runs
+
+private:
+    static constexpr size_t RING_SLOTS = 8192; // power of two
+    struct Slot { uint64_t seq, t0, t1, cmd; uint32_t tid, xseq0, xseq1; const char *name; char detail[32]; };
+    struct Ring { Slot slots[RING_SLOTS]; std::atomic<uint64_t> head{0}; };
+    struct RingHandle { Ring *ring = nullptr; ~RingHandle(); }; // gives the ring back on thread exit
+    static thread_local RingHandle mine_;
+
+    const XConnection *xc_ = nullptr;
+    std::atomic<bool> active_{false};
+    std::mutex mtx_;
+    std::vector<std::unique_ptr<Ring>> rings_; // never freed: a finished thread's spans stay dumpable
+    std::vector<Ring*> free_;                  // rings of exited threads, reused by new ones
+    std::map<uint32_t, std::string> thread_names_;
+    std::string path_;
+    uint64_t started_ns_ = 0;
+
+    Ring *ring(); // this thread's, assigned on its first span
+};
+
+class TraceSpan {
+public:
+    explicit TraceSpan(const char *name) : name_(Tracer::get().active() ? name : nullptr) {
+        if (!name_) return;
+        xseq0_ = Tracer::get().xseq(); t0_ = Tracer::now_ns();
+    }
+    // `detail` returns the span's detail string; it is only called while tracing, so
+    // TRACE_SPAN_D costs no formatting or allocation otherwise
+    template<class Detail>
+    TraceSpan(const char *name, Detail &&detail) : TraceSpan(name) { if (name_) detail_ = detail(); }
+    ~TraceSpan() { if (name_) Tracer::get().record(name_, detail_, t0_, xseq0_); }
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan &operator=(const TraceSpan&) = delete;
+private:
+    const char *name_;
+    std::string detail_;
+    uint64_t t0_ = 0;
+    uint32_t xseq0_ = 0;
+};
+
+// Spans opened on this thread within the scope are attributed to IPC request `id`
+class TraceCommand {
+public:
+    explicit TraceCommand(uint64_t id) : prev_(Tracer::current_cmd) { Tracer::current_cmd = id; }
+    ~TraceCommand() { Tracer::current_cmd = prev_; }
+private:
+    uint64_t prev_;
 };
 
+#define TRACE_CAT2(a, b) a##b
+#define TRACE_CAT(a, b) TRACE_CAT2(a, b)
+#define TRACE_SPAN(name) TraceSpan TRACE_CAT(trace_span_, __LINE__)(name)
+#define TRACE_SPAN_D(name, detail) TraceSpan TRACE_CAT(trace_span_, __LINE__)(name, [&]() -> std::string { return detail; })
+#define TRACE_COMMAND(id) TraceCommand TRACE_CAT(trace_cmd_, __LINE__)(id)
+#define TRACE_THREAD(name) Tracer::get().name_thread(name)
+#else
+#define TRACE_SPAN(name) ((void)0)
+#define TRACE_SPAN_D(name, detail) ((void)0)
+#define TRACE_COMMAND(id) ((void)0)
+#define TRACE_THREAD(name) ((void)0)
+#endif
+
 // -----------------------------
 // Frame (decoration) handling
 // -----------------------------
@@ -124,7 +448,17 @@ public:
     void set_border_width(BorderType t, int w);
     void set_border_color(BorderType t, const std::string &hex);
 
+    // Tabbed/stacked containers: one frame hosts all children of a TabGroup and only the
+    // active client is mapped inside it, below a strip with one cell per child.
+    // set_client unmaps the previous client and hands it back to the root, then reparents and
+    // maps c; old_alive = false when the previous client is being destroyed (no requests for it)
+    void set_client(WindowID c, bool old_alive = true);
+    void set_tabs(const std::vector<std::string> &titles, size_t active, bool stacked);
+
 private:
+    static constexpr int TAB_HEIGHT = 18;
+    int tab_strip_height() const; // 0 for a plain (single client) frame
+
     XConnection &xc_;
     WindowID client_;
     WindowID frame_win_ = 0; // the window we create and parent the client to
@@ -133,11 +467,16 @@ private:
     int outer_width_ = 4;
     std::string inner_color_ = "#222222";
     std::string outer_color_ = "#111111";
+    std::vector<std::string> tabs_;
+    size_t active_tab_ = 0;
+    bool stacked_ = false;
+    uint32_t gc_ = 0, font_ = 0; // for the tab strip, created on first draw
 };
 
 // -----------------------------
 // Window model
 // -----------------------------
+// WM_NORMAL_HINTS subset used by layouts (0 = unset)
 struct WmWindow {
     WindowID id;
     std::unique_ptr<Frame> frame;
@@ -150,15 +489,30 @@ struct WmWindow {
     std::string title;
     std::string cls; // WM_CLASS
     bool fullscreen = false;
+    SizeHints hints;
+    pid_t pid = 0;        // _NET_WM_PID, 0 if unknown
+    int group = 0;        // TabGroup id on its workspace (0 = not in a container)
+    int ignore_unmaps = 0; // UnmapNotify events caused by the WM itself (tab switches)
 };
 
 // -----------------------------
 // Monitor & Workspace
 // -----------------------------
 struct Monitor {
-    int x,y,w,h;
+    int x,y,w,h; // usable area (what layouts get): screen minus struts
     int id;
     std::vector<int> workspaces; // indices
+    Geometry screen{}; // full output geometry
+};
+
+// Tabbed/stacked container: its children share one slot in the layout and one Frame.
+// Only the active child is listed in Workspace::tiled, mapped, and owns the frame; the
+// others are unmapped and frameless, so switching tabs never relayouts the workspace.
+struct TabGroup {
+    std::vector<WindowID> children;
+    size_t active = 0;
+    bool stacked = false;
+    bool operator==(const TabGroup &o) const { return children == o.children && active == o.active && stacked == o.stacked; }
 };
 
 struct Workspace {
@@ -167,41 +521,232 @@ struct Workspace {
     std::vector<WindowID> floating; // floating windows
     int monitor_id = 0;
     bool visible = false;
+    WindowID focused = 0; // last focused window on this workspace (0 = none)
+    std::string layout = "bsp"; // Layout::name() of the layout arranging this workspace
+    std::map<int, TabGroup> groups; // tabbed/stacked containers by id
+};
+
+
+// -----------------------------
+// Persistent layout tree
+// -----------------------------
+// Nodes are immutable and shared between versions: an edit copies only the path from the
+// root to the touched leaf and reuses every other subtree. Keeping an old root around is
+// an O(1) snapshot (undo/redo, presets, read-only copies for IPC) and never needs a lock.
+struct LayoutNode;
+using LayoutTree = std::shared_ptr<const LayoutNode>;
+
+struct LayoutNode {
+    enum Kind { LEAF, SPLIT_H, SPLIT_V }; // SPLIT_H: children side by side, SPLIT_V: stacked
+    Kind kind = LEAF;
+    WindowID win = 0;    // LEAF only
+    double ratio = 0.5;  // share of the first child (splits only)
+    LayoutTree first, second;
+    size_t leaves = 1;   // number of windows in this subtree
 };
 
+// Tree operations. All are pure: they return the new root and return the very same pointer
+// when nothing changed, so callers can detect no-ops with a pointer compare.
+static LayoutTree tree_leaf(WindowID id);
+static LayoutTree tree_split(LayoutNode::Kind k, double ratio, LayoutTree a, LayoutTree b);
+static void tree_windows(const LayoutTree &t, std::vector<WindowID> &out);
+static LayoutTree tree_insert_rec(const LayoutTree &t, WindowID id, WindowID at, int depth); // splits leaf `at`
+static LayoutTree tree_remove(const LayoutTree &t, WindowID id);
+static LayoutTree tree_swap(const LayoutTree &t, WindowID a, WindowID b);
+static LayoutTree tree_resize(const LayoutTree &t, WindowID id, LayoutNode::Kind k, double delta);
+static void tree_geometries(const LayoutTree &t, const Geometry &area, std::map<WindowID, Geometry> &out);
+
 // -----------------------------
 // Layout interface and BSP implementation (skeleton)
 // -----------------------------
 class Layout {
 public:
     virtual ~Layout() = default;
+    virtual const char *name() const = 0; // key used by set-layout
     // Apply layout to workspace, adjusting window geometries in wm_windows map
     virtual void apply(Workspace &ws, std::map<WindowID, WmWindow> &wm_windows, const Monitor &m) = 0;
 
     // Optional helpers
     virtual void focus_next(Workspace &ws) {}
     virtual void focus_prev(Workspace &ws) {}
+    virtual void promote(WindowID id, Workspace &ws, std::map<WindowID, WmWindow> &wm_windows) {}
+    virtual void swap(WindowID a, WindowID b, Workspace &ws) {}
+    virtual void resize(WindowID id, int dx, int dy, Workspace &ws, const Monitor &m) {}
+    // `now` takes over the slot of `old` (tab switch); not an undo step
+    virtual void replace(WindowID old, WindowID now, Workspace &ws) {}
+
+    // Layout snapshots (only tree-based layouts keep history; others return nullptr/false)
+    virtual LayoutTree snapshot(const Workspace &ws) const { return nullptr; }
+    virtual void restore(Workspace &ws, LayoutTree t) {}
+    virtual bool undo(Workspace &ws) { return false; }
+    virtual bool redo(Workspace &ws) { return false; }
 };
 
 class BSPLayout : public Layout {
 public:
     BSPLayout();
     ~BSPLayout() override;
+    const char *name() const override { return "bsp"; }
     void apply(Workspace &ws, std::map<WindowID, WmWindow> &wm_windows, const Monitor &m) override;
     // Provide swap/move operations
-    void promote(WindowID id, Workspace &ws, std::map<WindowID, WmWindow> &wm_windows);
-    void swap(WindowID a, WindowID b, Workspace &ws);
+    void promote(WindowID id, Workspace &ws, std::map<WindowID, WmWindow> &wm_windows) override;
+    void swap(WindowID a, WindowID b, Workspace &ws) override;
+    void resize(WindowID id, int dx, int dy, Workspace &ws, const Monitor &m) override;
+    void replace(WindowID old, WindowID now, Workspace &ws) override;
+
+    LayoutTree snapshot(const Workspace &ws) const override;
+    void restore(Workspace &ws, LayoutTree t) override;
+    bool undo(Workspace &ws) override;
+    bool redo(Workspace &ws) override;
+
+private:
+    static constexpr size_t HISTORY_MAX = 64;
+    struct History { LayoutTree cur; std::vector<LayoutTree> undo, redo; };
+    std::map<int, History> trees_; // keyed by workspace index
+
+    void commit(int ws, LayoutTree t); // record an edit as one undo step
+    LayoutTree sync(const Workspace &ws); // reconcile the tree with ws.tiled
+};
+
+// -----------------------------
+// Constraint solver and constraint layout
+// -----------------------------
+// Solves   minimize  sum_k weight_k * (terms_k . x - rhs_k)^2
+//          subject to sum_i x_i = total,  lo_i <= x_i <= hi_i
+// with an active-set method over a dense KKT system (sizes are window counts, so dense is
+// fine). `active` holds the bound set (-1 at lo, +1 at hi, 0 free) and is both the warm
+// start and the result: re-solving after a small change starts from the previous active
+// set and usually finishes after a single factorisation.
+struct SolverTerm { int var; double coef; };
+struct SolverRow { std::vector<SolverTerm> terms; double rhs; double weight; };
+enum SolverStrength { WEAK = 1, MEDIUM = 100, STRONG = 10000 };
+
+static std::vector<double> solve_constraints(const std::vector<SolverRow> &rows, const std::vector<double> &lo,
+                                             const std::vector<double> &hi, double total, std::vector<int> &active);
+
+struct LayoutConstraint {
+    enum Kind { PIN, EQUAL };
+    Kind kind;
+    std::string a, b;  // window selectors: WM_CLASS or numeric window id
+    double value = 0;  // PIN: fraction of the usable width
+};
+
+// Columns left to right in ws.tiled order, sized by the solver. Every window has a weak
+// preference for an even share, pins are strong, equalities medium, and WM_NORMAL_HINTS
+// min/max sizes are required bounds.
+class ConstraintLayout : public Layout {
+public:
+    const char *name() const override { return "constraint"; }
+    void apply(Workspace &ws, std::map<WindowID, WmWindow> &wm_windows, const Monitor &m) override;
+
+    void add_constraint(int ws, const LayoutConstraint &c);
+    void clear_constraints(int ws);
+
+private:
+    // Previous solve per workspace; reused as-is when nothing changed, otherwise its
+    // active set seeds the next solve.
+    struct Solved {
+        std::vector<WindowID> wins;
+        std::vector<SizeHints> hints;
+        int width = -1;
+        uint64_t version = 0;
+        std::vector<double> x;
+        std::map<WindowID, int> active;
+    };
+    std::map<int, std::vector<LayoutConstraint>> constraints_;
+    std::map<int, uint64_t> versions_; // bumped on every constraint edit
+    std::map<int, Solved> solved_;
+};
+
+// -----------------------------
+// External layout generator
+// -----------------------------
+// Delegates geometry to a process listening on a UNIX socket. Per relayout the WM sends one
+// JSON line and expects one JSON line back:
+//   -> {"workspace":2,"area":[x,y,w,h],"windows":[{"id":..,"class":"..","min":[w,h],"max":[w,h]},..]}
+//   <- {"geometries":[[id,x,y,w,h],..]}
+// The reply must arrive within the latency budget; otherwise (or on any error) the
+// fallback layout is used for that relayout and the generator is skipped for a short
+// back-off period so a dead generator cannot stall every relayout.
+class ExternalLayout : public Layout {
+public:
+    ExternalLayout(const std::string &name, const std::string &sockpath, int timeout_ms, Layout &fallback);
+    ~ExternalLayout() override;
+    const char *name() const override { return name_.c_str(); }
+    void apply(Workspace &ws, std::map<WindowID, WmWindow> &wm_windows, const Monitor &m) override;
+
+private:
+    // a failed connect or exchange waits before the next attempt, doubling up to the max
+    static constexpr int BACKOFF_MIN_MS = 250, BACKOFF_MAX_MS = 30000;
+    std::string name_;
+    std::string sockpath_;
+    int timeout_ms_;
+    Layout &fallback_;
+    int fd_ = -1;
+    std::string rbuf_; // bytes received past the last reply line
+    std::chrono::steady_clock::time_point retry_after_{};
+    int backoff_ms_ = BACKOFF_MIN_MS; // the next wait; back to the min after a good reply
+
+    bool connect_generator();
+    void disconnect_generator();
+    bool exchange(const std::string &req, std::string &reply); // one line out, one line back
+};
+
+// -----------------------------
+// Native layout plugins (C ABI in hibriwm_layout.h)
+// -----------------------------
+// In-process alternative to ExternalLayout: the plugin's arrange() fills caller-owned
+// buffers that are kept across relayouts, so a relayout costs no IPC and no allocation.
+// The .so is re-stat'ed on every apply and reloaded when its mtime changes.
+class PluginLayout : public Layout {
+public:
+    PluginLayout(const std::string &path, Layout &fallback);
+    ~PluginLayout() override;
+    bool load(); // (re)load the shared object; false leaves the layout on its fallback
+    const char *name() const override { return name_.c_str(); }
+    void apply(Workspace &ws, std::map<WindowID, WmWindow> &wm_windows, const Monitor &m) override;
+
+private:
+    std::string path_;
+    std::string name_;
+    Layout &fallback_;
+    void *handle_ = nullptr;
+    const hwm_layout_plugin_t *plugin_ = nullptr;
+    void *state_ = nullptr;
+    fs::file_time_type mtime_{};
+    std::vector<hwm_window_t> in_;
+    std::vector<hwm_rect_t> out_;
+
+    void unload();
 };
 
 // -----------------------------
 // Rules engine (matchers -> actions)
 // -----------------------------
+// Predicate over a window and its workspace, compiled from "field<op>value" terms
+// (op: = equal, != not equal, ~ contains), all of which must hold. Shared by rules, hooks
+// and queries. Fields: class, title, id, pid, floating, fullscreen, workspace, layout, monitor.
+class Matcher {
+public:
+    bool add_term(const std::string &term); // false if the term does not parse
+    bool empty() const { return terms_.empty(); }
+    // W/S: WmWindow/Workspace, or their StateSnapshot copies; either may be null
+    template <class W, class S> bool matches(const W *win, const S *ws) const;
+
+private:
+    enum Field { CLASS, TITLE, ID, PID, FLOATING, FULLSCREEN, WORKSPACE, LAYOUT, MONITOR };
+    enum Op { EQ, NE, CONTAINS };
+    struct Term { Field field; Op op; std::string value; long num; };
+    std::vector<Term> terms_;
+};
+
 struct Rule {
-    std::string match_class; // e.g., "Firefox"
+    Matcher match; // e.g., class=Firefox
     std::optional<int> workspace;
     std::optional<int> monitor_id;
     std::optional<bool> floating;
     std::optional<std::string> area; // relative geometry string
+    std::optional<std::string> macro; // run once the window is placed
 };
 
 class RulesEngine {
@@ -212,23 +757,144 @@ private:
     std::vector<Rule> rules_;
 };
 
+// -----------------------------
+// Window index: secondary indexes for `query windows`
+// -----------------------------
+// Kept in step with windows_ by the WindowManager (update() wherever an indexed field
+// changes, remove() when a window goes away), so a query only visits the windows of its
+// most selective equality term instead of scanning every window.
+class WindowIndex {
+public:
+    using Bucket = std::shared_ptr<const std::set<WindowID>>;
+    template<class K> using Field = std::shared_ptr<const std::map<K, Bucket>>;
+    // The lookup side, copied into every StateSnapshot in O(1): each field map and each
+    // bucket stays shared with the index until a write copies the ones it touches
+    struct View {
+        Field<std::string> by_class;
+        Field<int> by_workspace;
+        Field<pid_t> by_pid;
+        Bucket floating[2], fullscreen[2]; // [false], [true]
+        // Windows whose `field` equals `value`; nullptr if the field is not indexed
+        const std::set<WindowID> *lookup(const std::string &field, const std::string &value) const;
+    };
+
+    void update(const WmWindow &w); // (re)files w under the field values that changed
+    void remove(WindowID id);
+    const std::set<WindowID> *lookup(const std::string &field, const std::string &value) const { return view_.lookup(field, value); }
+    const View &view() const { return view_; }
+
+private:
+    struct Key { std::string cls; int workspace; pid_t pid; bool floating, fullscreen; };
+    std::map<WindowID, Key> keys_; // what each window is currently filed under (writer only)
+    View view_;
+    static const std::set<WindowID> none_;
+};
+
+// -----------------------------
+// Shared-memory event ring (layout and consumer in hibriwm_ring.h)
+// -----------------------------
+// Single-producer/multi-consumer ring for consumers that want every event without a
+// socket write per event. The producer never waits for consumers: each slot carries its
+// sequence number so a lapped consumer can tell how many events it lost.
+class EventRing {
+public:
+    static constexpr uint32_t DEFAULT_SLOTS = 4096; // 1 MiB
+    EventRing() = default;
+    ~EventRing();
+    bool create(uint64_t first_seq, uint32_t nslots = DEFAULT_SLOTS);
+    bool ready() const { return ring_ != nullptr; }
+    void push(uint64_t seq, uint16_t type, const std::string &payload); // single producer, seq increasing by 1
+    int reader_fd() const { return ro_fd_; }
+
+private:
+    int fd_ = -1;
+    int ro_fd_ = -1;
+    hwm_ring_t *ring_ = nullptr;
+    size_t bytes_ = 0;
+};
+
+// -----------------------------
+// Flight recorder: the last events, commands and layouts in an mmap'd file (hibriwm_flight.h)
+// -----------------------------
+// Always on. A record is one atomic add and a 128-byte copy, no syscalls, and MAP_SHARED
+// pages reach the file even if the process dies, so hwm_flightdump can show what the WM
+// was doing before a crash or a hang.
+class FlightRecorder {
+public:
+    static constexpr uint32_t DEFAULT_RECS = 16384; // 2 MiB
+    FlightRecorder() = default;
+    ~FlightRecorder();
+    bool open(const std::string &path, uint32_t nrecs = DEFAULT_RECS); // an existing file becomes <path>.old
+    bool ready() const { return f_ != nullptr; }
+    void set_connection(const XConnection *xc) { xc_ = xc; } // records carry its last sequence number
+    // Any thread
+    void record(uint16_t kind, uint64_t a, uint64_t b, const char *text, size_t len) {
+        if (f_) hwm_flight_append(f_, kind, xc_ ? xc_->last_sequence() : 0, a, b, text, len);
+    }
+    void record(uint16_t kind, uint64_t a, uint64_t b, const std::string &text = std::string()) {
+        record(kind, a, b, text.data(), text.size());
+    }
+
+private:
+    hwm_flight_t *f_ = nullptr;
+    size_t bytes_ = 0;
+    const XConnection *xc_ = nullptr;
+};
+
 // -----------------------------
 // IPC Server: accepts commands, pushes them to the main loop
 // -----------------------------
 class IPCServer {
 public:
-    using CommandHandler = std::function<void(const std::string&)>;
+    // Takes a command line from client `fd` (with its request id, 0 if untagged) and returns
+    // its reply line ("OK", "ERR ..."), which may only become ready once the main loop has
+    // executed the command
+    using CommandHandler = std::function<std::future<std::string>(const std::string &line, int fd, uint64_t id)>;
 
     IPCServer(const std::string &sockpath);
     ~IPCServer();
 
     // Start listening in a background thread. Commands will be forwarded to handler.
+    // A line may carry a request id ("#<id> <command>"); its reply then starts with the
+    // same "#<id> ", so clients can pipeline commands over one connection.
     void start(CommandHandler handler);
     void stop();
 
     // Emit events to subscribed clients (bar). This writes JSON lines to connected clients.
+    // Every event gets the next sequence number ("seq") and is kept in a bounded journal
+    // so `subscribe since=<seq>` can replay what a reconnecting client missed.
     void emit_event(const WmEvent &ev);
 
+    // Builds the compact full-state snapshot sent when a client's seq has aged out of the
+    // journal (or it has none). Called without any IPCServer lock held.
+    using SnapshotProvider = std::function<json()>;
+    void set_snapshot_provider(SnapshotProvider p) { snapshot_ = std::move(p); }
+
+    // `get-tree`: the writer streams "<prefix><json>\n" straight to the client socket
+    using TreeWriter = std::function<void(int fd, const std::string &prefix)>;
+    void set_tree_writer(TreeWriter w) { tree_ = std::move(w); }
+
+    // Read-only `query ...` lines: the returned line is the reply (JSON, or "ERR ...")
+    using QueryHandler = std::function<std::string(const std::string&)>;
+    void set_query_handler(QueryHandler q) { query_ = std::move(q); }
+
+    // Ready-to-pipe bar lines for `subscribe format=lemonbar` clients (rendered by BarPublisher)
+    void emit_bar_line(const std::string &line);
+
+    // Called with the fd of every connection that closes
+    void set_disconnect_handler(std::function<void(int)> h) { on_disconnect_ = std::move(h); }
+
+    // fd handed out by the `state-fd` command (read-only memfd of the state page)
+    void set_state_fd(int fd) { state_fd_ = fd; }
+
+    // Signals the eventfd of every event-ring consumer if events were pushed since the
+    // last call; the main loop calls this once per iteration.
+    void notify_ring();
+    // Retries what subscribers' sockets did not take; the main loop calls this once per
+    // iteration and, while has_pending(), polls with a short timeout.
+    void flush_pending();
+    bool has_pending();
+
 private:
     std::string sockpath_;
     int server_fd_ = -1;
@@ -236,12 +902,41 @@ private:
     std::atomic<bool> running_{false};
 
     std::mutex clients_mtx_;
-    std::vector<int> client_fds_; // simple list of connected clients for events
+    std::vector<int> client_fds_; // every connection (closed on stop)
+    std::vector<int> subscribers_; // connections that sent `subscribe` and receive events
+    std::vector<int> bar_subscribers_; // `subscribe format=lemonbar`: bar lines instead of JSON
+    std::string last_bar_line_;
+    static constexpr size_t JOURNAL_MAX = 1024;
+    std::deque<std::pair<uint64_t, std::string>> journal_; // (seq, serialized event line)
+    std::atomic<uint64_t> next_seq_{1};
+    SnapshotProvider snapshot_;
+    QueryHandler query_;
+    TreeWriter tree_;
+    std::function<void(int)> on_disconnect_;
+    std::map<std::string, std::string> last_value_; // topic -> last serialized event line
+    std::atomic<int> state_fd_{-1};
+    EventRing ring_;                  // created on the first `event-ring` request
+    std::map<int, int> ring_consumers_; // client fd -> its eventfd
+    bool ring_dirty_ = false;
+    Metrics::Counter &fanout_bytes_ = metrics().counter("hibriwm_ipc_fanout_bytes_total", "Bytes written to subscribed clients");
+    // Subscribers are written without blocking: what a socket does not take waits here and
+    // goes first next time; a client more than PENDING_MAX behind is disconnected
+    static constexpr size_t PENDING_MAX = 1 << 20;
+    std::map<int, std::string> pending_; // client fd -> unsent bytes
+    Metrics::Counter &dropped_ = metrics().counter("hibriwm_ipc_subscribers_dropped_total", "Subscribers disconnected for falling behind");
 
     // internal helpers
     void accept_loop(CommandHandler handler);
     void handle_client(int client_fd, CommandHandler handler);
-    void send_to_clients(const std::string &s);
+    void send_to_clients(const std::string &s); // caller holds clients_mtx_
+    // Non-blocking write to a subscriber, caller holds clients_mtx_; false if it was dropped
+    bool queue(int fd, std::vector<iovec> iov);
+    bool queue(int fd, const std::string &s) { return queue(fd, std::vector<iovec>{iovec{(void*)s.data(), s.size()}}); }
+    void drop_subscriber(int fd); // caller holds clients_mtx_
+    bool subscribed(int fd); // caller holds clients_mtx_
+    void write_reply(int fd, const std::string &s); // client thread: behind queued events if subscribed
+    bool attach_ring_consumer(int client_fd, const std::string &tag); // false: no ring (the caller answers ERR)
+    void subscribe(int client_fd, const std::string &args);
 };
 
 // -----------------------------
@@ -253,18 +948,33 @@ public:
     ~InputManager();
 
     void register_default_bindings();
+    // keycombo: modifiers and a key joined by '-', e.g. "Mod4-Shift-Return"; false if unparseable
+    static bool valid_combo(const std::string &keycombo);
     void bind_key(const std::string &keycombo, const std::string &cmd);
     void bind_button(const std::string &btncombo, const std::string &cmd);
 
     // Called by main loop on KeyPress/ButtonPress events so we can route them
     void handle_key_event(xcb_key_press_event_t *ev);
+    void refresh_keymap(); // MappingNotify: reload keysyms, grab every binding again
     void handle_button_event(xcb_button_press_event_t *ev);
 
+    // Bound commands are handed to `dispatch` (queued in the input class, ahead of IPC)
+    using Dispatch = std::function<void(const std::string&)>;
+    void set_dispatch(Dispatch d) { dispatch_ = std::move(d); }
+    void run_binding(const std::string &combo);
+
 private:
     XConnection &xc_;
     IPCServer &ipc_;
-    std::map<std::string, std::string> keymap_; // simple mapping
+    Dispatch dispatch_;
+    std::map<std::string, std::string> keymap_; // canonical combo (combo_name) -> command
     std::map<std::string, std::string> btnmap_;
+    // keysym in the first column for each keycode from min_keycode_, loaded outside the
+    // key-press path so translating a key never waits on the server
+    std::vector<uint32_t> keysyms_;
+    uint8_t min_keycode_ = 0;
+    void load_keymap();
+    void grab(const std::string &combo);
 };
 
 // -----------------------------
@@ -281,12 +991,88 @@ public:
     // Start inotify watcher to reload on change and call reload_callback
     void watch(std::function<void()> reload_callback);
 
+    // run_once() on the loader's own thread, never the caller's: the main loop has to stay
+    // free to execute what the script sends. Requests that arrive while a script runs are
+    // coalesced into one more run after it, so two scripts never run at once. Any thread.
+    void reload();
+    // Stops watching and waits for a running script; later reload() calls are ignored
+    void stop();
+
 private:
     std::string path_;
     IPCServer &ipc_;
     int inotify_fd_ = -1;
     std::thread watch_thread_;
     std::atomic<bool> watching_{false};
+    std::thread reload_thread_;
+    std::mutex reload_mtx_;
+    std::condition_variable reload_cv_;
+    bool reload_pending_ = false, stopped_ = false; // guarded by reload_mtx_
+};
+
+// -----------------------------
+// Shared-memory state page (layout and reader in hibriwm_state.h)
+// -----------------------------
+// A memfd-backed page rewritten under a seqlock by the main loop. Bars and tools map it
+// read-only and poll it instead of keeping their own copy of the event stream.
+class StatePage {
+public:
+    StatePage() = default;
+    ~StatePage();
+    bool create();
+    void publish(const hwm_state_t &st); // no-op when nothing changed since the last call
+    int reader_fd() const { return ro_fd_; }
+
+private:
+    int fd_ = -1;
+    int ro_fd_ = -1;
+    hwm_state_page_t *page_ = nullptr;
+};
+
+// -----------------------------
+// Native status bar (optional, `bar native true`)
+// -----------------------------
+// One override-redirect dock window per monitor, drawn with core X requests and a server
+// side font (no XRender/Cairo yet). Fed directly by BarPublisher::flush() in-process, it
+// repaints only the segments whose content changed: single workspace cells, the title,
+// the layout name. The WM reserves its height as a top strut on every monitor.
+struct BarCell { std::string label; std::string color; };
+
+class NativeBar {
+public:
+    explicit NativeBar(XConnection &xc);
+    ~NativeBar();
+    bool create(const std::map<int, Monitor> &monitors);
+    void destroy();
+    bool active() const { return !bars_.empty(); }
+    int height() const { return height_; }
+    void set_visible(bool visible);
+    void set_colors(const std::string &fg, const std::string &bg);
+    void update(const std::vector<BarCell> &cells, const std::string &title, const std::string &layout);
+    void expose(xcb_window_t win); // full repaint of one bar
+
+private:
+    struct Bar {
+        xcb_window_t win = 0;
+        xcb_gcontext_t gc = 0;
+        Geometry geom{};
+        bool damaged = true; // everything must be painted
+        std::vector<BarCell> cells; // what is currently on screen
+        std::string title, layout;
+    };
+    XConnection &xc_;
+    std::vector<Bar> bars_;
+    xcb_font_t font_ = 0;
+    int height_ = 20, char_w_ = 6, ascent_ = 11;
+    uint32_t fg_ = 0xffffff, bg_ = 0x222222;
+    bool visible_ = true;
+    std::vector<BarCell> cells_;
+    std::string title_, layout_;
+
+    void paint(Bar &b);
+    void fill(Bar &b, int x, int w, uint32_t color);
+    void text(Bar &b, int x, const std::string &s, uint32_t fg, uint32_t bg);
+    int cell_width(const BarCell &c) const { return int(c.label.size() + 2) * char_w_; }
 };
 
 // -----------------------------
@@ -294,21 +1080,241 @@ private:
 // -----------------------------
 class BarPublisher {
 public:
+    using Clock = std::chrono::steady_clock;
+
     BarPublisher(IPCServer &ipc);
     ~BarPublisher();
 
-    // push state events
+    // push state events. These only stage the latest state of their topic; flush() emits.
     void publish_workspace(int current, const std::vector<int> &occupied);
     void publish_focus(WindowID id, const std::string &title);
     void publish_bar_visible(bool visible);
+    void publish_layout(int monitor, int ws, const std::string &name);
+
+    // Emits every staged topic whose last emission is at least one interval old, merging
+    // all intermediate states into one event. Called at the end of each main-loop
+    // iteration; returns when it must run again for topics still held back, so the final
+    // state is always delivered.
+    std::optional<Clock::time_point> flush(Clock::time_point now);
+    void set_interval(std::chrono::milliseconds ms) { std::lock_guard<std::mutex> lk(mtx_); interval_ = ms; }
+
+    // lemonbar rendering, configured with `bar <key> <value>` and set-workspaces.
+    // Returns false for an unknown key.
+    bool set_format_option(const std::string &key, const std::string &value);
+    void set_workspace_names(const std::map<int, std::string> &names);
+    void set_native(NativeBar *nb) { std::lock_guard<std::mutex> lk(mtx_); native_ = nb; render_dirty_ = true; }
 
 private:
+    // What the bar shows, updated from the events flush() emits; rendered into one
+    // lemonbar line per flush that changed anything.
+    struct BarFormat {
+        std::string format = "%{l}{workspaces}%{c}{title}%{r}{layout} ";
+        std::string active = "#88ccff", occupied = "#aaaaaa", empty = "#444444";
+        bool occupied_only = false;
+        size_t title_max = 80; // in characters (UTF-8 code points)
+    };
+    struct BarModel {
+        std::map<int, std::string> names; // set-workspaces, in display order
+        int current = 0;
+        std::vector<int> occupied;
+        std::string title;
+        std::string layout;
+        bool visible = true;
+    };
+    BarFormat fmt_;
+    BarModel model_;
+    bool render_dirty_ = false;
+    NativeBar *native_ = nullptr; // in-process bar, drawn on the main loop from flush()
+    std::vector<BarCell> cells(); // caller holds mtx_
+    std::string render_line(); // caller holds mtx_
+
+    struct Topic {
+        WmEvent staged;
+        bool dirty = false;
+        json last_sent;          // an unchanged state is not re-emitted
+        Clock::time_point last{}; // time of the last emission
+    };
     IPCServer &ipc_;
+    std::mutex mtx_; // publish_* run on IPC threads as well as the main loop
+    std::map<std::string, Topic> topics_;
+    std::chrono::milliseconds interval_{16};
+
+    void stage(WmEvent e);
+};
+
+// -----------------------------
+// Scratchpads
+// -----------------------------
+// Named, pre-spawned windows ("scratch name:command"). The process is started when the
+// scratchpad is declared; its window is adopted as floating and parked unmapped, so a
+// toggle only moves, raises, maps and focuses an existing window in one request batch.
+struct Scratchpad {
+    std::string cmd;
+    pid_t pid = 0;            // spawned process, matched against _NET_WM_PID on adoption
+    WindowID win = 0;         // 0 while the process has not mapped its window yet
+    bool shown = false;
+    bool show_on_adopt = false; // toggled before the window existed
+    std::map<int, Geometry> geom; // last geometry per monitor id
+};
+
+// -----------------------------
+// Command scheduler: prioritised, fair queues in front of the main loop
+// -----------------------------
+// A command parsed once into a call with its arguments bound (see compile_command)
+using CompiledCommand = std::function<void()>;
+using Macro = std::vector<CompiledCommand>;
+
+// Every command executes on the main loop. Sources queue into their class and run() drains
+// input first, then config, then IPC; config and IPC work stops at a time budget per
+// iteration, so X events (key presses) are never stuck behind a flood. Within a class,
+// clients are served round-robin; IPC clients are rate-limited by a token bucket.
+// (Queries never queue: they read the published StateSnapshot on the IPC threads.)
+enum CommandClass { CMD_INPUT, CMD_CONFIG, CMD_IPC, CMD_CLASSES };
+
+class CommandScheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+    static constexpr const char *CLASS_NAMES[CMD_CLASSES] = {"input", "config", "ipc"};
+    CommandScheduler(); // registers the queue metrics
+    struct Job {
+        CompiledCommand run;
+        std::promise<std::string> done; // the reply line ("OK", "ERR ...")
+        Clock::time_point queued;
+        uint64_t req_id = 0; // "#<id>" of the IPC line
+        std::string line;    // for tracing and the flight recorder
+    };
+
+    // Queues a job for `client` (0 = the WM itself); a rate-limited job is answered
+    // "ERR rate limited" right away and false is returned. Any thread.
+    bool push(CommandClass cls, int client, Job job);
+    // Main loop: runs queued jobs until the queues are empty or `budget` is spent on
+    // non-input work. Returns true if work is left for the next iteration.
+    bool run(std::chrono::microseconds budget);
+    // Main loop, once the iteration's state is published: answers the jobs run() executed,
+    // so a client that got its OK reads a snapshot that already has the effect
+    void answer();
+    // Main loop, from inside a running job: its reply becomes `reply` instead of "OK"
+    // (the first failure of a macro's steps wins)
+    void fail(const std::string &reply) { if (result_ == "OK") result_ = reply; }
+    // Shutdown: every queued job, and any pushed later, is answered `reply` without running;
+    // a run() in progress returns after the current job. Any thread.
+    void close(const std::string &reply);
+
+    void set_rate(double per_sec, double burst); // IPC token bucket, per client
+    void set_client_class(int client, CommandClass cls);
+    CommandClass client_class(int client);
+    void forget_client(int client); // connection closed (fds are reused)
+    void set_flight_recorder(FlightRecorder *f) { flight_ = f; } // every job run is recorded
+    const Job *running() const { return running_.load(std::memory_order_relaxed); } // main thread (and its signal handlers)
+    size_t depth(CommandClass cls) const { return depth_[cls].load(std::memory_order_relaxed); }
+    const Histogram &wait(CommandClass cls) const { return wait_[cls]; } // queue wait, us
+    json stats() const;
+
+private:
+    struct Queue {
+        std::map<int, std::deque<Job>> per_client;
+        std::deque<int> turn; // clients with queued jobs, in round-robin order
+    };
+    struct Bucket { double tokens; Clock::time_point last; };
+    mutable std::mutex mtx_;
+    Queue queues_[CMD_CLASSES];
+    std::atomic<size_t> depth_[CMD_CLASSES] = {};
+    std::map<int, Bucket> buckets_;
+    std::map<int, CommandClass> classes_;
+    double rate_ = 2000, burst_ = 500;
+    Histogram wait_[CMD_CLASSES];
+    FlightRecorder *flight_ = nullptr;
+    std::atomic<const Job*> running_{nullptr};
+    std::vector<std::pair<std::promise<std::string>, std::string>> ran_; // main loop: run, not yet answered
+    std::string result_; // main loop: reply of the running job
+    std::atomic<bool> closed_{false};
+    std::string close_reply_; // guarded by mtx_
+    Metrics::Counter &rejected_ = metrics().counter("hibriwm_commands_rate_limited_total", "IPC commands refused by the rate limit");
+
+    bool pop(CommandClass cls, Job &out);
+};
+
+// -----------------------------
+// Main-loop stall watchdog
+// -----------------------------
+// The main loop marks each iteration busy() when it wakes and idle() before it polls again.
+// A thread checks that mark; once one iteration has been busy for longer than the
+// threshold it signals the main thread, whose handler records its own stack (backtrace)
+// and what it was running, and the report goes to the flight recorder and stderr, once
+// per stall. The handler only copies: symbols are resolved on the watchdog thread.
+class Watchdog {
+public:
+    static constexpr int SIGNAL = SIGUSR2;
+    ~Watchdog() { stop(); }
+    // Call on the main thread
+    bool start(FlightRecorder &flight, const XConnection &xc, const CommandScheduler &sched);
+    void stop();
+    void set_threshold(std::chrono::milliseconds t) { threshold_ns_ = std::chrono::nanoseconds(t).count(); }
+
+    void busy() { busy_since_.store(now_ns(), std::memory_order_relaxed); }
+    void idle() { busy_since_.store(0, std::memory_order_relaxed); phase.store("idle", std::memory_order_relaxed); }
+    // What the main loop is doing; written by it, read by the handler on the same thread
+    std::atomic<const char*> phase{"idle"};
+    std::atomic<int> event{-1}; // X event type being handled
+
+private:
+    static constexpr int MAX_FRAMES = 48;
+    static Watchdog *instance_;
+    static void on_signal(int);
+    static uint64_t now_ns();
+    void loop();
+    void report(uint64_t stalled_ns);
+
+    FlightRecorder *flight_ = nullptr;
+    const XConnection *xc_ = nullptr;
+    const CommandScheduler *sched_ = nullptr;
+    pthread_t main_{};
+    std::thread thread_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    bool running_ = false;
+    std::atomic<uint64_t> busy_since_{0};   // 0 while idle
+    std::atomic<uint64_t> threshold_ns_{250000000};
+    Metrics::Counter &stalls_ = metrics().counter("hibriwm_main_loop_stalls_total", "Iterations that exceeded the watchdog threshold");
+
+    // filled by on_signal
+    std::atomic<bool> captured_{false};
+    void *frames_[MAX_FRAMES];
+    int nframes_ = 0;
+    const char *cap_phase_ = "";
+    int cap_event_ = -1;
+    uint64_t cap_cmd_id_ = 0;
+    char cap_command_[HWM_FLIGHT_TEXT];
 };
 
 // -----------------------------
 // WindowManager (core) - orchestrates everything
 // -----------------------------
+// Immutable copy of the WM state for readers off the main loop (queries, get-tree, the
+// subscribe snapshot). The main loop publishes a new one after every iteration that changed
+// state; unchanged windows, workspaces and the index are shared with the previous one, and
+// layout trees are persistent, so capturing one is a pointer copy.
+struct StateSnapshot {
+    struct Window {
+        WindowID id; std::string cls, title; Geometry geom;
+        bool floating, fullscreen, scratch; pid_t pid; int workspace, group;
+    };
+    struct Ws {
+        int index, monitor_id; std::string layout; bool visible; WindowID focused;
+        LayoutTree tree; // nullptr for layouts without one: then `tiled` is the order
+        std::vector<WindowID> tiled, floating;
+        std::map<int, TabGroup> groups;
+    };
+    uint64_t gen = 0; // state generation it was taken at
+    int current_ws = 0;
+    WindowID focused = 0;
+    bool bar_visible = true;
+    std::vector<Monitor> monitors;
+    std::map<int, std::shared_ptr<const Ws>> workspaces;
+    std::map<WindowID, std::shared_ptr<const Window>> windows;
+    WindowIndex::View index;
+};
+
 class WindowManager {
 public:
     WindowManager();
@@ -325,10 +1331,23 @@ public:
     void cmd_resize_rel(int dx, int dy);
     void cmd_toggle_float(WindowID id);
     void cmd_swap(WindowID a, WindowID b);
+    void cmd_promote(WindowID id);
+    void cmd_layout_history(const std::string &op, const std::string &name); // undo|redo|save|load
+    void cmd_set_layout(const std::string &name, int ws);
+    void cmd_constraint(int ws, const std::string &op, const std::string &a, const std::string &b);
+    void cmd_layout_generator(const std::string &name, const std::string &sockpath, int timeout_ms);
+    void cmd_layout_plugin(const std::string &path);
+    void cmd_container(const std::string &mode); // tabbed|stacked|split
+    void cmd_tab_cycle(int delta);
     void cmd_send_to_ws(WindowID id, int ws, bool follow);
     void cmd_view_ws(int ws);
+    void cmd_move_ws(int ws, int monitor); // move-ws <ws> monitor <id>: show ws there
     void cmd_toggle_bar();
+    void cmd_bar_option(const std::string &key, const std::string &value); // bar <key> <value>
+    void cmd_set_workspaces(const std::vector<std::string> &defs); // "index:name" ...
     void cmd_scratch_toggle(const std::string &name);
+    void cmd_scratch_define(const std::string &def); // "name:command"
+    void cmd_run_macro(const std::string &name); // run <name>
     void cmd_set_border(BorderType type, int width);
     void cmd_set_color(BorderType type, const std::string &hex);
     void cmd_reload_config();
@@ -337,36 +1356,127 @@ public:
     // Event handlers from X
     void handle_map_request(xcb_map_request_event_t *ev);
     void handle_unmap_notify(xcb_unmap_notify_event_t *ev);
+    void handle_destroy_notify(xcb_destroy_notify_event_t *ev);
     void handle_configure_request(xcb_configure_request_event_t *ev);
     void handle_key_press(xcb_key_press_event_t *ev);
     void handle_button_press(xcb_button_press_event_t *ev);
 
 private:
+    void handle_event(xcb_generic_event_t *ev);
+    void end_iteration(); // once per main-loop iteration, after all pending work
+    void wake();          // interrupts the main loop's poll (state changed off-thread)
+    void submit(CommandClass cls, const std::string &cmdline); // queue a command from inside the WM
+    void fill_state(hwm_state_t &st);
+    // Parses one command line into a call with its arguments bound; nullopt if unknown.
+    // IPC lines, bindings and macro steps all go through here.
+    std::optional<CompiledCommand> compile_command(const std::string &cmdline);
+    json state_snapshot(); // payload of the "snapshot" event: latest value of every topic
+    std::string query(const std::string &q); // `query windows where ... fields=...`, IPC threads
+    void publish_snapshot(); // main loop, once per iteration; no-op unless state_gen_ moved
+    std::shared_ptr<const StateSnapshot> current_snapshot() const { return std::atomic_load(&snapshot_); }
+    void write_tree(int fd, const std::string &prefix);     // `get-tree`, IPC threads
+
     XConnection xc_;
-    IPCServer ipc_ {SOCK_PATH};
+    IPCServer ipc_ {hwm_socket_path()};
     InputManager *input_ = nullptr;
     ConfigLoader *cfg_ = nullptr;
     BarPublisher *bar_ = nullptr;
     RulesEngine rules_;
 
     std::atomic<bool> running_{false};
+    CommandScheduler sched_;
+    std::chrono::microseconds cmd_budget_{2000}; // per iteration, for config/IPC commands
+    FlightRecorder flight_;
+    Watchdog watchdog_;
+
+    // Metrics (main loop); `query metrics` exports them with everything else registered
+    Metrics::Counter *event_count_[128] = {}; // by X event type, registered on first sight
+    Histogram &loop_us_ = metrics().histogram("hibriwm_loop_iteration_microseconds", "Main-loop iteration, from wakeup to the end of end_iteration()");
+    Histogram &relayout_us_ = metrics().histogram("hibriwm_relayout_microseconds", "Layout::apply plus frame moves of one workspace");
+    Histogram &fork_us_ = metrics().histogram("hibriwm_spawn_fork_microseconds", "fork() in spawn_process, spent on the main loop");
+    Histogram &map_us_ = metrics().histogram("hibriwm_spawn_map_microseconds", "From spawn to the MapRequest of the spawned window");
+    std::map<pid_t, std::chrono::steady_clock::time_point> spawned_; // pid -> spawn time, until it maps
+    int wake_fd_ = -1; // eventfd polled by run() next to the X connection
+    StatePage state_page_;
+    bool bar_visible_ = true;
+    NativeBar *native_bar_ = nullptr; // `bar native true`; main loop only (commands, Expose, BarPublisher::flush)
+    std::optional<std::chrono::steady_clock::time_point> next_flush_; // pending coalesced bar events
+    static constexpr int IPC_RETRY_MS = 10; // poll timeout while a subscriber has unsent bytes
 
     // State
     std::map<WindowID, WmWindow> windows_;
+    WindowIndex index_; // secondary indexes over windows_
     std::map<int, Workspace> workspaces_;
     std::map<int, Monitor> monitors_;
+    // External docks/panels: mapped as they are and never managed, only their
+    // _NET_WM_STRUT_PARTIAL (left, right, top, bottom, then start/end of each) counts
+    std::map<WindowID, std::array<uint32_t, 12>> struts_;
     int current_ws_ = 1;
-    std::unique_ptr<Layout> layout_; // e.g., BSPLayout
+    std::map<std::string, std::unique_ptr<Layout>> layouts_; // by Layout::name(), "bsp" is the default
+    ConstraintLayout *constraint_layout_ = nullptr; // owned by layouts_
+    std::map<std::string, LayoutTree> layout_presets_; // named snapshots ("layout save <name>")
 
     // Thread-safety primitives
     std::shared_mutex state_mtx_; // protects windows_/workspaces_/monitors_
+    std::unique_lock<std::shared_mutex> lock_state(); // exclusive, unless this thread runs a macro; bumps state_gen_
+    std::atomic<uint64_t> state_gen_{1}; // generation of windows_/workspaces_/monitors_
+    std::shared_ptr<const StateSnapshot> snapshot_ = std::make_shared<StateSnapshot>(); // RCU: atomic_load/atomic_store only
+
+    // Macros: `macro <name> <cmd>; <cmd>; ...` compiled once, `run <name>` executes every
+    // step under one state lock with relayouts deferred to the end
+    static constexpr int MACRO_DEPTH_MAX = 8; // macros may `run` other macros
+    std::mutex macros_mtx_;
+    std::map<std::string, std::shared_ptr<const Macro>> macros_;
+    std::atomic<std::thread::id> batch_owner_{}; // thread running a macro batch
+    int macro_depth_ = 0;                        // only touched by batch_owner_
+    std::set<int> deferred_relayout_;            // workspaces relayouted when the batch ends
+    void run_macro(const std::string &name);     // caller holds state_mtx_
+    void run_steps(const Macro &m);              // caller holds state_mtx_
+    std::shared_ptr<const Macro> compile_steps(const std::string &body); // "<cmd>; <cmd>", null on error
+
+    // Hooks: predicates are checked when the event happens (fire_hooks), the command lists
+    // of the matching hooks run at the end of that main-loop iteration as one batch, with
+    // the event's window in the environment of anything they spawn (HWM_WIN, HWM_CLASS...)
+    struct Hook { std::string event; Matcher match; std::shared_ptr<const Macro> steps; };
+    struct HookFiring { std::shared_ptr<const Macro> steps; std::vector<std::string> env; };
+    std::vector<Hook> hooks_;               // guarded by state_mtx_
+    std::vector<HookFiring> pending_hooks_; // guarded by state_mtx_
+    std::atomic<bool> hooks_pending_{false};
+    WindowID hook_focus_ = 0;               // focus last reported to "focus" hooks
+    std::vector<std::string> spawn_env_;    // "K=V" added by spawn_process, set by run_hooks
+    void fire_hooks(const std::string &event, const WmWindow *w, const Workspace *ws); // caller holds state_mtx_
+    void run_hooks(); // main loop
 
     // Helpers
     void adopt_new_window(WindowID id);
+    // docks are told apart inside adopt_new_window's request batch: request_dock sends the
+    // reads, adopt_dock (after the round trip, state_mtx_ held) returns true if id is a dock,
+    // then mapped and its struts recorded
+    struct DockCookies { xcb_get_property_cookie_t type, partial, strut; };
+    DockCookies request_dock(WindowID id);
+    bool adopt_dock(WindowID id, const DockCookies &ck);
     void reparent_to_frame(WindowID id);
     void remove_window(WindowID id);
     void update_struts_and_area();
     void notify_workspace_change();
+    void notify_focus_change(); // caller holds state_mtx_
+    void focus_window(Workspace &ws, WindowID id); // 0 = root; caller holds state_mtx_ and flushes
+    WindowID neighbor(const Workspace &ws, WindowID id, const std::string &dir); // tiled, 0 if none
+    Workspace &workspace(int index); // creates on first use
+    void show_on_monitor(int index, int monitor); // the one visible there is hidden; caller holds state_mtx_
+    const Monitor &monitor_for(const Workspace &ws);
+    WindowID focused_window();
+    Layout &layout_for(const Workspace &ws);
+    void add_layout(std::unique_ptr<Layout> l);
+    void relayout(int ws); // caller holds state_mtx_
+    void show_tab(Workspace &ws, int gid, size_t idx, bool old_gone = false); // swap the active child, no relayout
+    void update_tabs(Workspace &ws, int gid);
+    void dissolve_group(Workspace &ws, int gid);
+    int next_group_ = 1;
+    std::map<std::string, Scratchpad> scratchpads_;
+    pid_t spawn_process(const std::string &cmdline);
+    bool adopt_scratchpad(WmWindow &w); // true if w belongs to a scratchpad (then parked)
+    void show_scratchpad(Scratchpad &sp);
 };
 
 // -----------------------------
@@ -380,6 +1490,10 @@ XConnection::~XConnection() { disconnect(); }
 bool XConnection::connect() {
     conn_ = xcb_connect(nullptr, &screen_num_);
     if (xcb_connection_has_error(conn_)) return false;
+    metrics().sampled("hibriwm_x_bytes_written_total", "Bytes written to the X server",
+                      "", [this]() { return conn_ ? (double)xcb_total_written(conn_) : 0.0; }, true);
+    metrics().sampled("hibriwm_x_bytes_read_total", "Bytes read from the X server",
+                      "", [this]() { return conn_ ? (double)xcb_total_read(conn_) : 0.0; }, true);
     setup_ = xcb_get_setup(conn_);
     xcb_screen_iterator_t iter = xcb_setup_roots_iterator(setup_);
     for (int i=0;i<screen_num_;++i) xcb_screen_next(&iter);
@@ -394,7 +1508,10 @@ void XConnection::disconnect() {
 }
 
 void XConnection::grab_key(uint16_t keycode, uint16_t modifiers) {
-    // TODO: call xcb_grab_key with proper mapping
+    // also with Lock and NumLock (Mod2) on, so bindings keep working with either
+    static const uint16_t extra[] = {0, XCB_MOD_MASK_LOCK, XCB_MOD_MASK_2, XCB_MOD_MASK_LOCK | XCB_MOD_MASK_2};
+    for (uint16_t e : extra)
+        sent(xcb_grab_key(conn_, 1, root_, modifiers | e, (xcb_keycode_t)keycode, XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC));
 }
 void XConnection::grab_button(uint8_t button, uint16_t modifiers) {
     // TODO: call xcb_grab_button
@@ -402,71 +1519,1036 @@ void XConnection::grab_button(uint8_t button, uint16_t modifiers) {
 void XConnection::set_wm_name(const std::string &name) {
     // TODO: set _NET_WM_NAME or X11 name
 }
-
-// Frame implementation (skeleton)
-Frame::Frame(XConnection &xc, WindowID client): xc_(xc), client_(client) {}
-Frame::~Frame() { destroy(); }
-void Frame::create() {
-    // TODO: create a new window (frame_win_), reparent client_ into it, set event masks
+xcb_atom_t XConnection::atom(const std::string &name) {
+    auto it = atoms_.find(name);
+    if (it != atoms_.end()) return it->second;
+    round_trip();
+    xcb_intern_atom_reply_t *r = xcb_intern_atom_reply(conn_, sent(xcb_intern_atom(conn_, 0, name.size(), name.c_str())), nullptr);
+    xcb_atom_t a = r ? r->atom : (xcb_atom_t)XCB_ATOM_NONE;
+    free(r);
+    return atoms_[name] = a;
 }
-void Frame::destroy() {
-    // TODO: unparent, destroy frame if exists
+void XConnection::intern(const std::vector<std::string> &names) {
+    std::vector<std::pair<std::string, xcb_intern_atom_cookie_t>> pending;
+    for (const std::string &n : names)
+        if (!atoms_.count(n)) pending.emplace_back(n, sent(xcb_intern_atom(conn_, 0, n.size(), n.c_str())));
+    if (pending.empty()) return;
+    round_trip();
+    for (auto &p : pending) {
+        xcb_intern_atom_reply_t *r = xcb_intern_atom_reply(conn_, p.second, nullptr);
+        atoms_[p.first] = r ? r->atom : (xcb_atom_t)XCB_ATOM_NONE;
+        free(r);
+    }
 }
-void Frame::draw() {
-    // TODO: draw borders using cairo or XCB poly functions
+std::optional<uint32_t> XConnection::get_cardinal(xcb_window_t w, xcb_atom_t prop) {
+    round_trip();
+    return cardinal_reply(request_cardinal(w, prop));
 }
-void Frame::move_resize(const Geometry &g) {
-    geom_ = g;
-    // TODO: xcb configure window positions for frame and client
+std::string XConnection::get_text(xcb_window_t w, xcb_atom_t prop) {
+    round_trip();
+    return text_reply(request_text(w, prop));
 }
-void Frame::set_border_width(BorderType t, int w) {
-    if (t==INNER_BORDER) inner_width_ = w; else outer_width_ = w;
+xcb_get_property_cookie_t XConnection::request_cardinal(xcb_window_t w, xcb_atom_t prop) {
+    return sent(xcb_get_property(conn_, 0, w, prop, XCB_ATOM_CARDINAL, 0, 1));
 }
-void Frame::set_border_color(BorderType t, const std::string &hex) {
-    if (t==INNER_BORDER) inner_color_ = hex_color_sanitize(hex); else outer_color_ = hex_color_sanitize(hex);
+xcb_get_property_cookie_t XConnection::request_text(xcb_window_t w, xcb_atom_t prop) {
+    return sent(xcb_get_property(conn_, 0, w, prop, XCB_GET_PROPERTY_TYPE_ANY, 0, 256));
 }
-
-// BSPLayout skeleton
-BSPLayout::BSPLayout() {}
-BSPLayout::~BSPLayout() {}
-void BSPLayout::apply(Workspace &ws, std::map<WindowID, WmWindow> &wm_windows, const Monitor &m) {
-    // TODO: compute tree partitions and set wm_windows[id].geom_tiled accordingly
+xcb_get_property_cookie_t XConnection::request_size_hints(xcb_window_t w) {
+    return sent(xcb_get_property(conn_, 0, w, XCB_ATOM_WM_NORMAL_HINTS, XCB_ATOM_WM_SIZE_HINTS, 0, 18));
 }
-void BSPLayout::promote(WindowID id, Workspace &ws, std::map<WindowID, WmWindow> &wm_windows) {
-    // TODO: move id to master area
+std::optional<uint32_t> XConnection::cardinal_reply(xcb_get_property_cookie_t ck) {
+    xcb_get_property_reply_t *r = xcb_get_property_reply(conn_, ck, nullptr);
+    std::optional<uint32_t> v;
+    if (r && xcb_get_property_value_length(r) >= 4) v = *(uint32_t*)xcb_get_property_value(r);
+    free(r);
+    return v;
 }
-void BSPLayout::swap(WindowID a, WindowID b, Workspace &ws) {
-    // TODO: swap positions of two windows in the layout
+std::string XConnection::text_reply(xcb_get_property_cookie_t ck) {
+    xcb_get_property_reply_t *r = xcb_get_property_reply(conn_, ck, nullptr);
+    std::string v;
+    if (r) v.assign((const char*)xcb_get_property_value(r), xcb_get_property_value_length(r));
+    free(r);
+    return v;
 }
-
-// RulesEngine skeleton
-void RulesEngine::add_rule(const Rule &r) { rules_.push_back(r); }
-std::optional<Rule> RulesEngine::match(WindowID id, const WmWindow &w) {
-    // TODO: match rule by class/title/exe etc. For now simple class match
-    for (auto &r : rules_) if (!r.match_class.empty() && r.match_class==w.cls) return r;
-    return std::nullopt;
+SizeHints XConnection::size_hints_reply(xcb_get_property_cookie_t ck) {
+    xcb_get_property_reply_t *r = xcb_get_property_reply(conn_, ck, nullptr);
+    SizeHints h;
+    if (r && r->format == 32 && xcb_get_property_value_length(r) >= 9 * 4) {
+        // flags, x, y, width, height, min_width, min_height, max_width, max_height, ...
+        const uint32_t *v = (const uint32_t*)xcb_get_property_value(r);
+        if (v[0] & 16) { h.min_w = (int)v[5]; h.min_h = (int)v[6]; } // PMinSize
+        if (v[0] & 32) { h.max_w = (int)v[7]; h.max_h = (int)v[8]; } // PMaxSize
+    }
+    free(r);
+    return h;
+}
+std::vector<Geometry> XConnection::outputs() {
+    std::vector<Geometry> out;
+    round_trip();
+    xcb_randr_get_monitors_reply_t *r = xcb_randr_get_monitors_reply(conn_, sent(xcb_randr_get_monitors(conn_, root_, 1)), nullptr);
+    if (!r) return out;
+    for (auto it = xcb_randr_get_monitors_monitors_iterator(r); it.rem; xcb_randr_monitor_info_next(&it)) {
+        Geometry g{it.data->x, it.data->y, it.data->width, it.data->height};
+        if (it.data->primary) out.insert(out.begin(), g); else out.push_back(g);
+    }
+    free(r);
+    return out;
 }
 
-// IPCServer implementation (skeleton)
-IPCServer::IPCServer(const std::string &sockpath): sockpath_(sockpath) {}
-IPCServer::~IPCServer() { stop(); }
-
-void IPCServer::start(CommandHandler handler) {
-    running_ = true;
-    // Create server socket
-    server_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (server_fd_<0) return;
-    sockaddr_un addr; memset(&addr,0,sizeof(addr)); addr.sun_family = AF_UNIX; strncpy(addr.sun_path, sockpath_.c_str(), sizeof(addr.sun_path)-1);
-    unlink(sockpath_.c_str());
-    bind(server_fd_, (sockaddr*)&addr, sizeof(addr));
-    listen(server_fd_, 8);
-    accept_thread_ = std::thread(&IPCServer::accept_loop, this, handler);
+XConnection::OpStats &XConnection::op_stats(const char *name) {
+    auto it = ops_.find(name);
+    if (it != ops_.end()) return it->second;
+    std::string lb = std::string("op=\"") + name + "\"";
+    OpStats st{&metrics().counter("hibriwm_x_op_requests_total", "X requests sent, by operation", lb),
+               &metrics().counter("hibriwm_x_op_round_trips_total", "Blocking waits for an X reply, by operation", lb),
+               &metrics().counter("hibriwm_x_hot_round_trips_total", "Round trips inside a hot operation (a bug)", lb)};
+    return ops_.emplace(name, st).first->second;
+}
+XConnection::Op::Op(XConnection &xc, const char *name, Kind kind) : xc_(xc), prev_(xc.op_) {
+    xc.op_ = OpState{&xc.op_stats(name), name, kind == HOT || (kind == NORMAL && prev_.hot)};
+}
+void XConnection::round_trip() {
+    round_trips_.add();
+    if (!op_.stats) return;
+    op_.stats->round_trips->add();
+    if (!op_.hot) return;
+    op_.stats->hot_round_trips->add();
+    uint64_t n = op_.stats->hot_round_trips->get();
+    if ((n & (n - 1)) == 0) // 1st, 2nd, 4th...: visible without flooding stderr
+        std::cerr << "hibriwm: synchronous X round trip in hot operation " << op_.name << " (" << n << " so far)\n";
+    assert(!"synchronous X round trip in a hot operation");
 }
 
-void IPCServer::stop() {
-    running_ = false;
-    if (server_fd_>=0) close(server_fd_);
-    if (accept_thread_.joinable()) accept_thread_.join();
+// Histogram implementation
+size_t Histogram::bucket(uint64_t v) {
+    if (v < (uint64_t)SUB) return v;
+    int msb = 63 - __builtin_clzll(v);
+    uint64_t top = v >> (msb - SUB_BITS); // in [SUB, 2*SUB)
+    return (size_t)(msb - SUB_BITS + 1) * SUB + (top - SUB);
+}
+uint64_t Histogram::bucket_upper(size_t b) {
+    if (b < (size_t)SUB) return b;
+    size_t shift = b / SUB - 1;
+    uint64_t top = SUB + b % SUB;
+    return ((top + 1) << shift) - 1;
+}
+void Histogram::record(uint64_t v) {
+    buckets_[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(v, std::memory_order_relaxed);
+    uint64_t m = max_.load(std::memory_order_relaxed);
+    while (v > m && !max_.compare_exchange_weak(m, v, std::memory_order_relaxed)) {}
+}
+uint64_t Histogram::quantile(double q) const {
+    uint64_t n = count(), seen = 0;
+    if (!n) return 0;
+    uint64_t rank = std::max<uint64_t>(1, (uint64_t)std::ceil(q * n));
+    for (size_t b = 0; b < BUCKETS; b++) {
+        seen += buckets_[b].load(std::memory_order_relaxed);
+        if (seen >= rank) return std::min(bucket_upper(b), max());
+    }
+    return max();
+}
+json Histogram::summary() const {
+    return {{"count", count()}, {"sum", sum()}, {"max", max()},
+            {"p50", quantile(0.5)}, {"p90", quantile(0.9)}, {"p99", quantile(0.99)}, {"p999", quantile(0.999)}};
+}
+
+// Metrics implementation
+Metrics &metrics() {
+    static Metrics m;
+    return m;
+}
+const Metrics::Entry *Metrics::find(const std::string &name, const std::string &labels) const {
+    for (const Entry &e : entries_) if (e.name == name && e.labels == labels) return &e;
+    return nullptr;
+}
+Metrics::Counter &Metrics::counter(const std::string &name, const std::string &help, const std::string &labels) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    if (const Entry *e = find(name, labels)) return *(Counter*)e->metric;
+    counters_.emplace_back();
+    entries_.push_back(Entry{name, help, labels, COUNTER, &counters_.back(), {}});
+    return counters_.back();
+}
+Metrics::Gauge &Metrics::gauge(const std::string &name, const std::string &help, const std::string &labels) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    if (const Entry *e = find(name, labels)) return *(Gauge*)e->metric;
+    gauges_.emplace_back();
+    entries_.push_back(Entry{name, help, labels, GAUGE, &gauges_.back(), {}});
+    return gauges_.back();
+}
+Histogram &Metrics::histogram(const std::string &name, const std::string &help, const std::string &labels) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    if (const Entry *e = find(name, labels)) return *(Histogram*)e->metric;
+    histograms_.emplace_back();
+    entries_.push_back(Entry{name, help, labels, HISTOGRAM, &histograms_.back(), {}});
+    return histograms_.back();
+}
+void Metrics::sampled(const std::string &name, const std::string &help, const std::string &labels, Sampler fn, bool monotonic) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    if (!find(name, labels)) entries_.push_back(Entry{name, help, labels, monotonic ? SAMPLED_COUNTER : SAMPLED, nullptr, std::move(fn)});
+}
+void Metrics::attach(const std::string &name, const std::string &help, const std::string &labels, const Histogram &h) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    if (!find(name, labels)) entries_.push_back(Entry{name, help, labels, HISTOGRAM, &h, {}});
+}
+json Metrics::to_json() const {
+    // {name: value} or, for labelled metrics, {name: {"k=v,...": value}}
+    std::lock_guard<std::mutex> lk(mtx_);
+    json j = json::object();
+    for (const Entry &e : entries_) {
+        json v;
+        switch (e.kind) {
+            case COUNTER: v = ((const Counter*)e.metric)->get(); break;
+            case GAUGE: v = ((const Gauge*)e.metric)->get(); break;
+            case SAMPLED: case SAMPLED_COUNTER: v = e.fn(); break;
+            case HISTOGRAM: v = ((const Histogram*)e.metric)->summary(); break;
+        }
+        if (e.labels.empty()) { j[e.name] = std::move(v); continue; }
+        std::string key = e.labels;
+        key.erase(std::remove(key.begin(), key.end(), '"'), key.end());
+        j[e.name][key] = std::move(v);
+    }
+    return j;
+}
+std::string Metrics::to_prometheus() const {
+    // histograms are exported as summaries (quantiles + _sum + _count)
+    static const char *types[] = {"counter", "gauge", "gauge", "counter", "summary"};
+    std::lock_guard<std::mutex> lk(mtx_);
+    std::map<std::string, std::vector<const Entry*>> by_name; // one HELP/TYPE per family
+    for (const Entry &e : entries_) by_name[e.name].push_back(&e);
+    std::ostringstream out;
+    for (auto &p : by_name) {
+        const Entry &first = *p.second.front();
+        out << "# HELP " << p.first << " " << first.help << "\n# TYPE " << p.first << " " << types[first.kind] << "\n";
+        for (const Entry *e : p.second) {
+            std::string lb = e->labels.empty() ? "" : "{" + e->labels + "}";
+            switch (e->kind) {
+                case COUNTER: out << p.first << lb << " " << ((const Counter*)e->metric)->get() << "\n"; break;
+                case GAUGE: out << p.first << lb << " " << ((const Gauge*)e->metric)->get() << "\n"; break;
+                case SAMPLED: case SAMPLED_COUNTER: out << p.first << lb << " " << e->fn() << "\n"; break;
+                case HISTOGRAM: {
+                    const Histogram &h = *(const Histogram*)e->metric;
+                    std::string sep = e->labels.empty() ? "" : e->labels + ",";
+                    for (const char *q : {"0.5", "0.9", "0.99", "0.999"})
+                        out << p.first << "{" << sep << "quantile=\"" << q << "\"} " << h.quantile(atof(q)) << "\n";
+                    out << p.first << "_sum" << lb << " " << h.sum() << "\n" << p.first << "_count" << lb << " " << h.count() << "\n";
+                    break;
+                }
+            }
+        }
+    }
+    out << "# EOF";
+    return out.str();
+}
+
+// Tracer implementation
+#ifdef HIBRIWM_TRACE
+thread_local uint64_t Tracer::current_cmd = 0;
+thread_local Tracer::RingHandle Tracer::mine_;
+
+Tracer &Tracer::get() {
+    static Tracer t;
+    return t;
+}
+uint64_t Tracer::now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+static uint32_t trace_tid() {
+    static thread_local uint32_t tid = (uint32_t)syscall(SYS_gettid);
+    return tid;
+}
+Tracer::RingHandle::~RingHandle() {
+    if (!ring) return;
+    Tracer &t = Tracer::get();
+    std::lock_guard<std::mutex> lk(t.mtx_);
+    t.free_.push_back(ring);
+}
+Tracer::Ring *Tracer::ring() {
+    if (mine_.ring) return mine_.ring;
+    std::lock_guard<std::mutex> lk(mtx_);
+    if (!free_.empty()) { mine_.ring = free_.back(); free_.pop_back(); }
+    else { rings_.push_back(std::make_unique<Ring>()); mine_.ring = rings_.back().get(); }
+    return mine_.ring;
+}
+void Tracer::name_thread(const std::string &name) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    thread_names_[trace_tid()] = name;
+}
+void Tracer::record(const char *name, const std::string &detail, uint64_t t0, uint32_t xseq0) {
+    Ring *r = ring();
+    uint64_t h = r->head.load(std::memory_order_relaxed);
+    Slot &s = r->slots[h & (RING_SLOTS - 1)];
+    __atomic_store_n(&s.seq, 0, __ATOMIC_RELAXED); // being written
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    s.t0 = t0; s.t1 = now_ns(); s.cmd = current_cmd;
+    s.tid = trace_tid(); s.xseq0 = xseq0; s.xseq1 = xseq();
+    s.name = name;
+    size_t n = std::min(detail.size(), sizeof(s.detail) - 1);
+    memcpy(s.detail, detail.data(), n); s.detail[n] = 0;
+    __atomic_store_n(&s.seq, h + 1, __ATOMIC_RELEASE);
+    r->head.store(h + 1, std::memory_order_release);
+}
+bool Tracer::start(const std::string &path) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    path_ = path.empty() ? std::string(dir && *dir ? dir : "/tmp") + "/hibriwm-trace.json" : path;
+    started_ns_ = now_ns();
+    active_ = true;
+    return true;
+}
+bool Tracer::stop(const std::string &path) {
+    if (!active_.exchange(false)) return false;
+    // copy the spans out now (cheap), format and write them off the calling thread
+    std::vector<Slot> spans;
+    std::map<uint32_t, std::string> names;
+    std::string out_path;
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        out_path = path.empty() ? path_ : path;
+        names = thread_names_;
+        for (auto &r : rings_) {
+            uint64_t head = r->head.load(std::memory_order_acquire);
+            for (uint64_t i = head > RING_SLOTS ? head - RING_SLOTS : 0; i < head; i++) {
+                const Slot &s = r->slots[i & (RING_SLOTS - 1)];
+                Slot copy;
+                uint64_t s1 = __atomic_load_n(&s.seq, __ATOMIC_ACQUIRE);
+                memcpy(&copy, (const void*)&s, sizeof(copy));
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                if (s1 != i + 1 || __atomic_load_n(&s.seq, __ATOMIC_RELAXED) != s1) continue; // overwritten meanwhile
+                if (copy.t0 >= started_ns_) spans.push_back(copy);
+            }
+        }
+    }
+    std::thread([spans = std::move(spans), names = std::move(names), out_path]() {
+        json events = json::array();
+        int pid = getpid();
+        for (auto &p : names)
+            events.push_back({{"ph", "M"}, {"name", "thread_name"}, {"pid", pid}, {"tid", p.first}, {"args", {{"name", p.second}}}});
+        for (const Slot &s : spans) {
+            json args = {{"xseq", {s.xseq0, s.xseq1}}};
+            if (s.cmd) args["cmd"] = s.cmd;
+            if (s.detail[0]) args["detail"] = s.detail;
+            events.push_back({{"ph", "X"}, {"name", s.name}, {"pid", pid}, {"tid", s.tid},
+                              {"ts", s.t0 / 1000.0}, {"dur", (s.t1 - s.t0) / 1000.0}, {"args", std::move(args)}});
+        }
+        FILE *f = fopen(out_path.c_str(), "w");
+        if (!f) { std::cerr << "trace: cannot write " << out_path << "\n"; return; }
+        std::string doc = json{{"traceEvents", std::move(events)}, {"displayTimeUnit", "ns"}}.dump();
+        fwrite(doc.data(), 1, doc.size(), f);
+        fclose(f);
+    }).detach();
+    return true;
+}
+#endif
+
+// Frame implementation (skeleton)
+Frame::Frame(XConnection &xc, WindowID client): xc_(xc), client_(client) {}
+Frame::~Frame() { destroy(); }
+void Frame::create() {
+    // the client sits at (0, tab strip) inside the frame; SubstructureNotify brings its
+    // UnmapNotify/DestroyNotify, which the root no longer sees once it is reparented.
+    // A mapped client is unmapped and mapped again by the reparent: the caller counts that unmap.
+    if (frame_win_) return;
+    xcb_connection_t *c = xc_.conn();
+    frame_win_ = xcb_generate_id(c);
+    uint32_t vals[] = {color_pixel(outer_color_), XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY};
+    xc_.sent(xcb_create_window(c, XCB_COPY_FROM_PARENT, frame_win_, xc_.root(), geom_.x, geom_.y,
+                               std::max(geom_.w, 1), std::max(geom_.h, 1), 0, XCB_WINDOW_CLASS_INPUT_OUTPUT,
+                               XCB_COPY_FROM_PARENT, XCB_CW_BACK_PIXEL | XCB_CW_EVENT_MASK, vals));
+    xc_.sent(xcb_change_save_set(c, XCB_SET_MODE_INSERT, client_)); // back to the root if the WM dies
+    xc_.sent(xcb_reparent_window(c, client_, frame_win_, 0, tab_strip_height()));
+    xc_.sent(xcb_map_window(c, frame_win_));
+}
+void Frame::destroy() {
+    xcb_connection_t *c = xc_.conn();
+    if (gc_ && c) { xc_.sent(xcb_free_gc(c, gc_)); xc_.sent(xcb_close_font(c, font_)); }
+    gc_ = font_ = 0;
+    if (!frame_win_ || !c) return;
+    // destroying the frame would destroy the client with it: hand it back to the root first
+    // (a client that is already gone just makes that request fail)
+    xc_.sent(xcb_reparent_window(c, client_, xc_.root(), geom_.x, geom_.y + tab_strip_height()));
+    xc_.sent(xcb_change_save_set(c, XCB_SET_MODE_DELETE, client_));
+    xc_.sent(xcb_destroy_window(c, frame_win_));
+    frame_win_ = 0;
+}
+void Frame::draw() {
+    // TODO: draw borders using cairo or XCB poly functions
+    if (!frame_win_ || !tab_strip_height()) return;
+    // tab strip: tabbed = one cell per child side by side, stacked = one row each;
+    // the active child gets the inner colour, the others the outer one
+    xcb_connection_t *c = xc_.conn();
+    if (!gc_) {
+        font_ = xcb_generate_id(c);
+        xc_.sent(xcb_open_font(c, font_, 5, "fixed"));
+        gc_ = xcb_generate_id(c);
+        uint32_t v[] = {0, 0, font_};
+        xc_.sent(xcb_create_gc(c, gc_, frame_win_, XCB_GC_FOREGROUND | XCB_GC_BACKGROUND | XCB_GC_FONT, v));
+    }
+    int n = (int)tabs_.size(), w = geom_.w;
+    for (int i = 0; i < n; i++) {
+        int x = stacked_ ? 0 : w * i / n, y = stacked_ ? TAB_HEIGHT * i : 0;
+        int cw = stacked_ ? w : w * (i+1) / n - x;
+        bool on = (size_t)i == active_tab_;
+        uint32_t bg = color_pixel(on ? inner_color_ : outer_color_), fg = on ? 0xffffff : 0x999999;
+        xc_.sent(xcb_change_gc(c, gc_, XCB_GC_FOREGROUND, &bg));
+        xcb_rectangle_t r{(int16_t)x, (int16_t)y, (uint16_t)std::max(cw, 1), (uint16_t)TAB_HEIGHT};
+        xc_.sent(xcb_poly_fill_rectangle(c, frame_win_, gc_, 1, &r));
+        uint32_t tv[] = {fg, bg};
+        xc_.sent(xcb_change_gc(c, gc_, XCB_GC_FOREGROUND | XCB_GC_BACKGROUND, tv));
+        std::string t = tabs_[i].substr(0, std::clamp(cw / 6 - 1, 0, 255)); // "fixed" is 6px wide; ImageText8 limit
+        xc_.sent(xcb_image_text_8(c, t.size(), frame_win_, gc_, x + 3, y + TAB_HEIGHT - 5, t.c_str()));
+    }
+}
+void Frame::move_resize(const Geometry &g) {
+    TRACE_SPAN("Frame::move_resize");
+    geom_ = g;
+    if (!frame_win_) return;
+    xcb_connection_t *c = xc_.conn();
+    int strip = tab_strip_height();
+    uint32_t fv[] = {(uint32_t)g.x, (uint32_t)g.y, (uint32_t)std::max(g.w, 1), (uint32_t)std::max(g.h, 1)};
+    uint32_t cv[] = {0, (uint32_t)strip, (uint32_t)std::max(g.w, 1), (uint32_t)std::max(g.h - strip, 1)};
+    uint16_t xywh = XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
+    xc_.sent(xcb_configure_window(c, frame_win_, xywh, fv));
+    xc_.sent(xcb_configure_window(c, client_, xywh, cv));
+}
+int Frame::tab_strip_height() const {
+    if (tabs_.size() < 2) return 0;
+    return stacked_ ? TAB_HEIGHT * (int)tabs_.size() : TAB_HEIGHT;
+}
+void Frame::set_client(WindowID c, bool old_alive) {
+    if (c == client_) return;
+    TRACE_SPAN("Frame::set_client");
+    if (frame_win_) {
+        xcb_connection_t *conn = xc_.conn();
+        if (old_alive) {
+            // hidden tabs wait on the root: destroying the frame must not take them along
+            xc_.sent(xcb_unmap_window(conn, client_));
+            xc_.sent(xcb_reparent_window(conn, client_, xc_.root(), 0, 0));
+            xc_.sent(xcb_change_save_set(conn, XCB_SET_MODE_DELETE, client_));
+        }
+        xc_.sent(xcb_change_save_set(conn, XCB_SET_MODE_INSERT, c));
+        xc_.sent(xcb_reparent_window(conn, c, frame_win_, 0, tab_strip_height()));
+        xc_.sent(xcb_map_window(conn, c));
+    }
+    client_ = c;
+    move_resize(geom_);
+}
+void Frame::set_tabs(const std::vector<std::string> &titles, size_t active, bool stacked) {
+    TRACE_SPAN("Frame::set_tabs");
+    bool resized = titles.size() != tabs_.size() || stacked != stacked_;
+    tabs_ = titles; active_tab_ = active; stacked_ = stacked;
+    if (resized) move_resize(geom_); // strip height changed, client moves
+    draw();
+}
+void Frame::set_border_width(BorderType t, int w) {
+    if (t==INNER_BORDER) inner_width_ = w; else outer_width_ = w;
+}
+void Frame::set_border_color(BorderType t, const std::string &hex) {
+    if (t==INNER_BORDER) inner_color_ = hex_color_sanitize(hex); else outer_color_ = hex_color_sanitize(hex);
+}
+
+// Persistent layout tree
+static LayoutTree tree_leaf(WindowID id) {
+    auto n = std::make_shared<LayoutNode>(); n->win = id;
+    return n;
+}
+static LayoutTree tree_split(LayoutNode::Kind k, double ratio, LayoutTree a, LayoutTree b) {
+    auto n = std::make_shared<LayoutNode>();
+    n->kind = k; n->ratio = ratio; n->leaves = a->leaves + b->leaves;
+    n->first = std::move(a); n->second = std::move(b);
+    return n;
+}
+// Rebuilds `t` with new children, sharing `t` itself when both children are unchanged
+static LayoutTree tree_rebuild(const LayoutTree &t, LayoutTree a, LayoutTree b) {
+    if (a == t->first && b == t->second) return t;
+    if (!a) return b;
+    if (!b) return a;
+    return tree_split(t->kind, t->ratio, std::move(a), std::move(b));
+}
+static void tree_windows(const LayoutTree &t, std::vector<WindowID> &out) {
+    if (!t) return;
+    if (t->kind == LayoutNode::LEAF) { out.push_back(t->win); return; }
+    tree_windows(t->first, out); tree_windows(t->second, out);
+}
+static LayoutTree tree_insert_rec(const LayoutTree &t, WindowID id, WindowID at, int depth) {
+    if (t->kind == LayoutNode::LEAF) {
+        if (t->win != at) return t;
+        // alternate split direction with depth, new window takes the second half
+        return tree_split(depth % 2 ? LayoutNode::SPLIT_V : LayoutNode::SPLIT_H, 0.5, t, tree_leaf(id));
+    }
+    LayoutTree a = tree_insert_rec(t->first, id, at, depth+1);
+    LayoutTree b = a != t->first ? t->second : tree_insert_rec(t->second, id, at, depth+1);
+    return tree_rebuild(t, a, b);
+}
+static LayoutTree tree_remove(const LayoutTree &t, WindowID id) {
+    if (!t) return t;
+    if (t->kind == LayoutNode::LEAF) return t->win == id ? nullptr : t;
+    // the sibling of a removed leaf takes over its parent's slot
+    return tree_rebuild(t, tree_remove(t->first, id), tree_remove(t->second, id));
+}
+static LayoutTree tree_swap(const LayoutTree &t, WindowID a, WindowID b) {
+    if (!t || a == b) return t;
+    if (t->kind == LayoutNode::LEAF) {
+        if (t->win == a) return tree_leaf(b);
+        if (t->win == b) return tree_leaf(a);
+        return t;
+    }
+    return tree_rebuild(t, tree_swap(t->first, a, b), tree_swap(t->second, a, b));
+}
+// found: id lives in t; delta is zeroed once applied so only the nearest split of kind k moves
+static LayoutTree tree_resize_rec(const LayoutTree &t, WindowID id, LayoutNode::Kind k, double &delta, bool &found) {
+    if (t->kind == LayoutNode::LEAF) { found = t->win == id; return t; }
+    bool in_a = false, in_b = false;
+    LayoutTree a = tree_resize_rec(t->first, id, k, delta, in_a);
+    LayoutTree b = in_a ? t->second : tree_resize_rec(t->second, id, k, delta, in_b);
+    found = in_a || in_b;
+    if (found && delta != 0 && t->kind == k) {
+        double r = std::clamp(t->ratio + (in_a ? delta : -delta), 0.05, 0.95);
+        delta = 0;
+        return tree_split(t->kind, r, a, b);
+    }
+    return tree_rebuild(t, a, b);
+}
+static LayoutTree tree_resize(const LayoutTree &t, WindowID id, LayoutNode::Kind k, double delta) {
+    if (!t) return t;
+    bool found = false;
+    return tree_resize_rec(t, id, k, delta, found);
+}
+static void tree_geometries(const LayoutTree &t, const Geometry &area, std::map<WindowID, Geometry> &out) {
+    if (!t) return;
+    if (t->kind == LayoutNode::LEAF) { out[t->win] = area; return; }
+    Geometry a = area, b = area;
+    if (t->kind == LayoutNode::SPLIT_H) {
+        a.w = int(area.w * t->ratio); b.x = area.x + a.w; b.w = area.w - a.w;
+    } else {
+        a.h = int(area.h * t->ratio); b.y = area.y + a.h; b.h = area.h - a.h;
+    }
+    tree_geometries(t->first, a, out); tree_geometries(t->second, b, out);
+}
+
+// BSPLayout skeleton
+BSPLayout::BSPLayout() {}
+BSPLayout::~BSPLayout() {}
+void BSPLayout::commit(int ws, LayoutTree t) {
+    History &h = trees_[ws];
+    if (t == h.cur) return;
+    h.undo.push_back(h.cur);
+    if (h.undo.size() > HISTORY_MAX) h.undo.erase(h.undo.begin());
+    h.redo.clear();
+    h.cur = std::move(t);
+}
+LayoutTree BSPLayout::sync(const Workspace &ws) {
+    History &h = trees_[ws.index];
+    LayoutTree t = h.cur;
+    std::vector<WindowID> have; tree_windows(t, have);
+    std::unordered_set<WindowID> tiled(ws.tiled.begin(), ws.tiled.end()), in_tree;
+    WindowID last = 0;
+    for (WindowID id : have)
+        if (!tiled.count(id)) t = tree_remove(t, id);
+        else { in_tree.insert(id); last = id; }
+    for (WindowID id : ws.tiled) {
+        if (in_tree.count(id)) continue;
+        // new windows split the focused leaf, or the last one if focus is not tiled here
+        WindowID at = in_tree.count(ws.focused) ? ws.focused : last;
+        t = t ? tree_insert_rec(t, id, at, 0) : tree_leaf(id);
+        in_tree.insert(id); last = id;
+    }
+    // membership changes are not undo steps; they are replayed onto whatever tree is current
+    h.cur = t;
+    return t;
+}
+void BSPLayout::apply(Workspace &ws, std::map<WindowID, WmWindow> &wm_windows, const Monitor &m) {
+    std::map<WindowID, Geometry> geoms;
+    tree_geometries(sync(ws), Geometry{m.x, m.y, m.w, m.h}, geoms);
+    for (auto &p : geoms) {
+        auto it = wm_windows.find(p.first);
+        if (it != wm_windows.end()) it->second.geom_tiled = p.second;
+    }
+}
+void BSPLayout::promote(WindowID id, Workspace &ws, std::map<WindowID, WmWindow> &wm_windows) {
+    // the master area is the first leaf in tree order
+    if (std::find(ws.tiled.begin(), ws.tiled.end(), id) == ws.tiled.end()) return;
+    LayoutTree t = sync(ws);
+    std::vector<WindowID> wins; tree_windows(t, wins);
+    if (!wins.empty()) commit(ws.index, tree_swap(t, id, wins.front()));
+}
+void BSPLayout::swap(WindowID a, WindowID b, Workspace &ws) {
+    // swapping with a window that is not a leaf here would rename the leaf instead
+    if (std::find(ws.tiled.begin(), ws.tiled.end(), a) == ws.tiled.end()
+        || std::find(ws.tiled.begin(), ws.tiled.end(), b) == ws.tiled.end()) return;
+    commit(ws.index, tree_swap(sync(ws), a, b));
+}
+void BSPLayout::resize(WindowID id, int dx, int dy, Workspace &ws, const Monitor &m) {
+    LayoutTree t = sync(ws);
+    if (dx && m.w > 0) t = tree_resize(t, id, LayoutNode::SPLIT_H, double(dx) / m.w);
+    if (dy && m.h > 0) t = tree_resize(t, id, LayoutNode::SPLIT_V, double(dy) / m.h);
+    commit(ws.index, t);
+}
+void BSPLayout::replace(WindowID old, WindowID now, Workspace &ws) {
+    History &h = trees_[ws.index];
+    h.cur = tree_swap(h.cur, old, now); // `now` is not in the tree, so this renames the leaf
+}
+LayoutTree BSPLayout::snapshot(const Workspace &ws) const {
+    auto it = trees_.find(ws.index);
+    return it == trees_.end() ? nullptr : it->second.cur;
+}
+void BSPLayout::restore(Workspace &ws, LayoutTree t) { commit(ws.index, std::move(t)); }
+bool BSPLayout::undo(Workspace &ws) {
+    History &h = trees_[ws.index];
+    if (h.undo.empty()) return false;
+    h.redo.push_back(h.cur); h.cur = h.undo.back(); h.undo.pop_back();
+    return true;
+}
+bool BSPLayout::redo(Workspace &ws) {
+    History &h = trees_[ws.index];
+    if (h.redo.empty()) return false;
+    h.undo.push_back(h.cur); h.cur = h.redo.back(); h.redo.pop_back();
+    return true;
+}
+
+// Constraint solver
+// Solves the equality-constrained subproblem with the bound-active variables pinned:
+//   H_ff x_f + lambda = g_f - H_fF x_F,   sum x_f = total - sum x_F
+// Returns false if the system is singular.
+static bool solve_kkt(const std::vector<std::vector<double>> &H, const std::vector<double> &g, double total,
+                      const std::vector<int> &active, std::vector<double> &x, double &lambda) {
+    const size_t n = x.size();
+    std::vector<size_t> fr;
+    double rest = total;
+    for (size_t i=0;i<n;++i) { if (active[i]) rest -= x[i]; else fr.push_back(i); }
+    const size_t m = fr.size();
+    if (m == 0) { lambda = 0; return true; }
+    std::vector<std::vector<double>> A(m+1, std::vector<double>(m+2, 0.0)); // augmented matrix
+    for (size_t r=0;r<m;++r) {
+        size_t i = fr[r];
+        double rhs = g[i];
+        for (size_t j=0;j<n;++j) if (active[j]) rhs -= H[i][j] * x[j];
+        for (size_t c=0;c<m;++c) A[r][c] = H[i][fr[c]];
+        A[r][m] = 1.0; A[r][m+1] = rhs;
+    }
+    for (size_t c=0;c<m;++c) A[m][c] = 1.0;
+    A[m][m+1] = rest;
+    // Gaussian elimination with partial pivoting
+    for (size_t c=0;c<=m;++c) {
+        size_t piv = c;
+        for (size_t r=c+1;r<=m;++r) if (std::abs(A[r][c]) > std::abs(A[piv][c])) piv = r;
+        if (std::abs(A[piv][c]) < 1e-12) return false;
+        std::swap(A[c], A[piv]);
+        for (size_t r=0;r<=m;++r) {
+            if (r == c || A[r][c] == 0) continue;
+            double f = A[r][c] / A[c][c];
+            for (size_t k=c;k<=m+1;++k) A[r][k] -= f * A[c][k];
+        }
+    }
+    for (size_t r=0;r<m;++r) x[fr[r]] = A[r][m+1] / A[r][r];
+    lambda = A[m][m+1] / A[m][m];
+    return true;
+}
+
+static std::vector<double> solve_constraints(const std::vector<SolverRow> &rows, const std::vector<double> &lo,
+                                             const std::vector<double> &hi, double total, std::vector<int> &active) {
+    const size_t n = lo.size();
+    std::vector<double> x(n, n ? total / n : 0);
+    if (n == 0) return x;
+    active.resize(n, 0);
+    double lo_sum = 0;
+    for (double v : lo) lo_sum += v;
+    if (lo_sum >= total) { // minimum sizes do not fit: shrink them proportionally
+        for (size_t i=0;i<n;++i) x[i] = lo_sum > 0 ? lo[i] * total / lo_sum : total / n;
+        return x;
+    }
+    // normal equations of the weighted least-squares objective
+    std::vector<std::vector<double>> H(n, std::vector<double>(n, 0.0));
+    std::vector<double> g(n, 0.0);
+    for (const SolverRow &r : rows)
+        for (const SolverTerm &a : r.terms) {
+            g[a.var] += r.weight * a.coef * r.rhs;
+            for (const SolverTerm &b : r.terms) H[a.var][b.var] += r.weight * a.coef * b.coef;
+        }
+    for (size_t i=0;i<n;++i) if (active[i]) x[i] = active[i] < 0 ? lo[i] : hi[i];
+    double lambda = 0;
+    for (size_t iter=0; iter < 4*n + 4; ++iter) {
+        if (!solve_kkt(H, g, total, active, x, lambda)) break;
+        // 1) a free variable left its box: pin the worst offender
+        size_t worst = n; double viol = 0.5; // sub-pixel violations do not matter
+        for (size_t i=0;i<n;++i) {
+            if (active[i]) continue;
+            double v = std::max(lo[i] - x[i], x[i] - hi[i]);
+            if (v > viol) { viol = v; worst = i; }
+        }
+        if (worst < n) {
+            active[worst] = x[worst] < lo[worst] ? -1 : 1;
+            x[worst] = active[worst] < 0 ? lo[worst] : hi[worst];
+            continue;
+        }
+        // 2) a pinned variable wants to move back inside: release the one pulling hardest
+        size_t rel = n; double pull = -1e-9;
+        for (size_t i=0;i<n;++i) {
+            if (!active[i]) continue;
+            double grad = lambda - g[i];
+            for (size_t j=0;j<n;++j) grad += H[i][j] * x[j];
+            double mu = active[i] < 0 ? grad : -grad; // KKT multiplier, must be >= 0
+            if (mu < pull) { pull = mu; rel = i; }
+        }
+        if (rel == n) break; // optimal
+        active[rel] = 0;
+    }
+    return x;
+}
+
+// ExternalLayout
+ExternalLayout::ExternalLayout(const std::string &name, const std::string &sockpath, int timeout_ms, Layout &fallback)
+    : name_(name), sockpath_(sockpath), timeout_ms_(timeout_ms > 0 ? timeout_ms : 20), fallback_(fallback) {}
+ExternalLayout::~ExternalLayout() { disconnect_generator(); }
+bool ExternalLayout::connect_generator() {
+    if (fd_ >= 0) return true;
+    // non-blocking throughout: a stuck generator costs at most timeout_ms_ per attempt
+    fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd_ < 0) return false;
+    sockaddr_un addr; memset(&addr,0,sizeof(addr)); addr.sun_family = AF_UNIX; strncpy(addr.sun_path, sockpath_.c_str(), sizeof(addr.sun_path)-1);
+    if (::connect(fd_, (sockaddr*)&addr, sizeof(addr)) == 0) return true;
+    int err = errno;
+    pollfd pfd{fd_, POLLOUT, 0};
+    socklen_t len = sizeof(err);
+    if (err == EINPROGRESS && poll(&pfd, 1, timeout_ms_) == 1
+        && getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) return true;
+    disconnect_generator();
+    return false;
+}
+void ExternalLayout::disconnect_generator() {
+    if (fd_ >= 0) close(fd_);
+    fd_ = -1; rbuf_.clear();
+}
+bool ExternalLayout::exchange(const std::string &req, std::string &reply) {
+    // one deadline for the whole request: sending (a full socket buffer) and the reply
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms_);
+    auto wait = [&](short ev) {
+        int left = (int)std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        pollfd pfd{fd_, ev, 0};
+        return left > 0 && poll(&pfd, 1, left) > 0;
+    };
+    for (size_t off = 0; off < req.size();) {
+        ssize_t w = send(fd_, req.data() + off, req.size() - off, MSG_NOSIGNAL); // no SIGPIPE if it died
+        if (w > 0) off += w;
+        else if (w < 0 && errno == EINTR) continue;
+        else if (w < 0 && errno == EAGAIN && wait(POLLOUT)) continue;
+        else return false;
+    }
+    char buf[4096];
+    size_t pos;
+    while ((pos = rbuf_.find('\n')) == std::string::npos) {
+        ssize_t r = read(fd_, buf, sizeof(buf));
+        if (r > 0) { rbuf_.append(buf, r); continue; }
+        if (r == 0 || (errno != EAGAIN && errno != EINTR) || (errno == EAGAIN && !wait(POLLIN))) return false;
+    }
+    reply = rbuf_.substr(0, pos);
+    rbuf_.erase(0, pos+1);
+    return true;
+}
+void ExternalLayout::apply(Workspace &ws, std::map<WindowID, WmWindow> &wm_windows, const Monitor &m) {
+    auto now = std::chrono::steady_clock::now();
+    if (now >= retry_after_ && connect_generator()) {
+        json req; req["workspace"] = ws.index; req["area"] = {m.x, m.y, m.w, m.h};
+        json wins = json::array();
+        for (WindowID id : ws.tiled) {
+            auto it = wm_windows.find(id);
+            if (it == wm_windows.end()) continue;
+            const SizeHints &h = it->second.hints;
+            wins.push_back({{"id", id}, {"class", it->second.cls}, {"min", {h.min_w, h.min_h}}, {"max", {h.max_w, h.max_h}}});
+        }
+        req["windows"] = std::move(wins);
+        std::string reply;
+        if (exchange(req.dump()+"\n", reply)) {
+            json j = json::parse(reply, nullptr, false);
+            if (!j.is_discarded() && j.contains("geometries") && j["geometries"].is_array()) {
+                for (auto &g : j["geometries"]) {
+                    if (!g.is_array() || g.size() != 5 || !std::all_of(g.begin(), g.end(), [](const json &v){ return v.is_number(); })) continue;
+                    auto it = wm_windows.find(g[0].get<WindowID>());
+                    if (it == wm_windows.end() || it->second.workspace != ws.index) continue;
+                    it->second.geom_tiled = Geometry{g[1].get<int>(), g[2].get<int>(), g[3].get<int>(), g[4].get<int>()};
+                }
+                backoff_ms_ = BACKOFF_MIN_MS;
+                return;
+            }
+        }
+        // late or garbled replies would desynchronise the stream: start over on a new connection
+        disconnect_generator();
+    }
+    if (now >= retry_after_) { // this attempt failed: a dead generator must not cost a connect per relayout
+        retry_after_ = now + std::chrono::milliseconds(backoff_ms_);
+        backoff_ms_ = std::min(backoff_ms_ * 2, BACKOFF_MAX_MS);
+    }
+    fallback_.apply(ws, wm_windows, m);
+}
+
+// PluginLayout
+PluginLayout::PluginLayout(const std::string &path, Layout &fallback): path_(path), fallback_(fallback) {}
+PluginLayout::~PluginLayout() { unload(); }
+void PluginLayout::unload() {
+    if (plugin_ && plugin_->destroy) plugin_->destroy(state_);
+    if (handle_) dlclose(handle_);
+    handle_ = nullptr; plugin_ = nullptr; state_ = nullptr;
+}
+bool PluginLayout::load() {
+    std::error_code ec;
+    auto mtime = fs::last_write_time(path_, ec);
+    if (ec) return false;
+    unload();
+    mtime_ = mtime;
+    handle_ = dlopen(path_.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!handle_) { std::cerr << "layout-plugin: " << dlerror() << "\n"; return false; }
+    auto entry = (hwm_layout_entry_fn)dlsym(handle_, HIBRIWM_LAYOUT_ENTRY);
+    plugin_ = entry ? entry() : nullptr;
+    if (!plugin_ || plugin_->abi_version < HIBRIWM_LAYOUT_ABI_MIN || plugin_->abi_version > HIBRIWM_LAYOUT_ABI
+        || !plugin_->arrange || !plugin_->name) {
+        std::cerr << "layout-plugin: " << path_ << " is not a compatible layout plugin\n";
+        plugin_ = nullptr; unload();
+        return false;
+    }
+    if (name_.empty()) name_ = plugin_->name; // the registered name survives reloads
+    state_ = plugin_->create ? plugin_->create() : nullptr;
+    return true;
+}
+void PluginLayout::apply(Workspace &ws, std::map<WindowID, WmWindow> &wm_windows, const Monitor &m) {
+    std::error_code ec;
+    auto mtime = fs::last_write_time(path_, ec);
+    if (!ec && mtime != mtime_) load();
+    if (!plugin_) { fallback_.apply(ws, wm_windows, m); return; }
+    in_.clear();
+    for (WindowID id : ws.tiled) {
+        auto it = wm_windows.find(id);
+        if (it == wm_windows.end()) continue;
+        const WmWindow &w = it->second;
+        in_.push_back(hwm_window_t{id, id == ws.focused ? (uint32_t)HWM_WIN_FOCUSED : 0u,
+                                   w.hints.min_w, w.hints.min_h, w.hints.max_w, w.hints.max_h, w.cls.c_str()});
+    }
+    out_.assign(in_.size(), hwm_rect_t{0,0,0,0});
+    hwm_rect_t area{m.x, m.y, m.w, m.h};
+    if (plugin_->arrange(state_, ws.index, &area, in_.data(), in_.size(), out_.data()) != 0) {
+        fallback_.apply(ws, wm_windows, m);
+        return;
+    }
+    for (size_t i=0;i<in_.size();++i)
+        wm_windows[in_[i].id].geom_tiled = Geometry{out_[i].x, out_[i].y, out_[i].w, out_[i].h};
+}
+
+// ConstraintLayout
+void ConstraintLayout::add_constraint(int ws, const LayoutConstraint &c) {
+    constraints_[ws].push_back(c); ++versions_[ws];
+}
+void ConstraintLayout::clear_constraints(int ws) {
+    constraints_.erase(ws); ++versions_[ws];
+}
+void ConstraintLayout::apply(Workspace &ws, std::map<WindowID, WmWindow> &wm_windows, const Monitor &m) {
+    Solved &prev = solved_[ws.index];
+    std::vector<WindowID> wins;
+    std::vector<SizeHints> hints;
+    for (WindowID id : ws.tiled) {
+        auto it = wm_windows.find(id);
+        if (it == wm_windows.end()) continue;
+        wins.push_back(id); hints.push_back(it->second.hints);
+    }
+    const size_t n = wins.size();
+    uint64_t version = versions_[ws.index];
+    bool same_hints = prev.hints.size() == n && std::equal(hints.begin(), hints.end(), prev.hints.begin(),
+        [](const SizeHints &a, const SizeHints &b) { return a.min_w==b.min_w && a.max_w==b.max_w; });
+    if (wins != prev.wins || m.w != prev.width || version != prev.version || !same_hints) {
+        std::vector<double> lo(n), hi(n);
+        std::vector<SolverRow> rows;
+        std::map<WindowID, int> var;
+        for (size_t i=0;i<n;++i) {
+            var[wins[i]] = int(i);
+            lo[i] = std::min(hints[i].min_w, m.w);
+            hi[i] = hints[i].max_w > 0 ? std::max<double>(hints[i].max_w, lo[i]) : m.w;
+            rows.push_back({{{int(i), 1.0}}, double(m.w) / n, WEAK});
+        }
+        auto select = [&](const std::string &sel) {
+            std::vector<int> out;
+            char *end = nullptr;
+            unsigned long id = strtoul(sel.c_str(), &end, 0);
+            for (size_t i=0;i<n;++i) {
+                const WmWindow &w = wm_windows.at(wins[i]);
+                if (w.cls == sel || (end && *end == 0 && id == w.id)) out.push_back(int(i));
+            }
+            return out;
+        };
+        for (const LayoutConstraint &c : constraints_[ws.index]) {
+            if (c.kind == LayoutConstraint::PIN)
+                for (int i : select(c.a)) rows.push_back({{{i, 1.0}}, c.value * m.w, STRONG});
+            else
+                for (int i : select(c.a)) for (int j : select(c.b))
+                    if (i != j) rows.push_back({{{i, 1.0}, {j, -1.0}}, 0.0, MEDIUM});
+        }
+        // warm start from the bounds that were active last time
+        std::vector<int> active(n, 0);
+        for (size_t i=0;i<n;++i) {
+            auto it = prev.active.find(wins[i]);
+            if (it != prev.active.end()) active[i] = it->second;
+        }
+        prev.x = solve_constraints(rows, lo, hi, m.w, active);
+        prev.active.clear();
+        for (size_t i=0;i<n;++i) prev.active[wins[i]] = active[i];
+        prev.wins = wins; prev.hints = hints; prev.width = m.w; prev.version = version;
+    }
+    // round on prefix sums so the columns tile the monitor exactly
+    double acc = 0;
+    int x0 = m.x;
+    for (size_t i=0;i<n;++i) {
+        acc += prev.x[i];
+        int x1 = m.x + int(std::lround(acc));
+        wm_windows[wins[i]].geom_tiled = Geometry{x0, m.y, x1 - x0, m.h};
+        x0 = x1;
+    }
+}
+
+// RulesEngine skeleton
+void RulesEngine::add_rule(const Rule &r) { rules_.push_back(r); }
+std::optional<Rule> RulesEngine::match(WindowID id, const WmWindow &w) {
+    // before placement: workspace fields never match
+    for (auto &r : rules_) if (!r.match.empty() && r.match.matches<WmWindow, Workspace>(&w, nullptr)) return r;
+    return std::nullopt;
+}
+
+bool Matcher::add_term(const std::string &term) {
+    static const std::map<std::string, Field> fields = {
+        {"class", CLASS}, {"title", TITLE}, {"id", ID}, {"pid", PID}, {"floating", FLOATING},
+        {"fullscreen", FULLSCREEN}, {"workspace", WORKSPACE}, {"layout", LAYOUT}, {"monitor", MONITOR}};
+    size_t p = term.find_first_of("!=~");
+    if (p == std::string::npos || p == 0) return false;
+    auto f = fields.find(term.substr(0, p));
+    if (f == fields.end()) return false;
+    Term t{f->second, EQ, "", 0};
+    if (term[p]=='~') t.op = CONTAINS;
+    else if (term[p]=='!') { if (term.compare(p, 2, "!=")) return false; t.op = NE; p++; }
+    t.value = term.substr(p+1);
+    bool numeric = t.field==ID || t.field==PID || t.field==WORKSPACE || t.field==MONITOR;
+    if (numeric) { if (t.op == CONTAINS) return false; t.num = strtol(t.value.c_str(), nullptr, 0); }
+    if (t.field==FLOATING || t.field==FULLSCREEN) t.num = t.value=="true" || t.value=="1";
+    terms_.push_back(std::move(t));
+    return true;
+}
+
+template <class W, class S> bool Matcher::matches(const W *win, const S *ws) const {
+    for (const Term &t : terms_) {
+        bool win_field = t.field <= FULLSCREEN;
+        if (win_field ? !win : !ws) return false;
+        const std::string *str = nullptr;
+        long num = 0;
+        switch (t.field) {
+            case CLASS: str = &win->cls; break;
+            case TITLE: str = &win->title; break;
+            case ID: num = win->id; break;
+            case PID: num = win->pid; break;
+            case FLOATING: num = win->floating; break;
+            case FULLSCREEN: num = win->fullscreen; break;
+            case WORKSPACE: num = ws->index; break;
+            case LAYOUT: str = &ws->layout; break;
+            case MONITOR: num = ws->monitor_id; break;
+        }
+        bool hit = str ? (t.op == CONTAINS ? str->find(t.value) != std::string::npos : *str == t.value) : num == t.num;
+        if (hit == (t.op == NE)) return false;
+    }
+    return true;
+}
+
+// WindowIndex implementation
+const std::set<WindowID> WindowIndex::none_;
+
+// Copy-on-write: a map or set still referenced by a snapshot is copied before the first
+// write, one only the index holds is written in place. Objects are created non-const
+// (make_shared<T>), so writing through the const_cast is sound.
+template<class T> static T &cow(std::shared_ptr<const T> &p) {
+    if (!p) p = std::make_shared<T>();
+    else if (p.use_count() > 1) p = std::make_shared<T>(*p);
+    return const_cast<T&>(*p);
+}
+template<class K> static void index_link(WindowIndex::Field<K> &f, const K &key, WindowID id) {
+    cow(cow(f)[key]).insert(id);
+}
+template<class K> static void index_unlink(WindowIndex::Field<K> &f, const K &key, WindowID id) {
+    if (!f || !f->count(key)) return;
+    auto &m = cow(f);
+    auto it = m.find(key);
+    cow(it->second).erase(id);
+    if (it->second->empty()) m.erase(it);
+}
+
+void WindowIndex::update(const WmWindow &w) {
+    Key k{w.cls, w.workspace, w.pid, w.floating, w.fullscreen};
+    auto it = keys_.find(w.id);
+    const Key *o = it != keys_.end() ? &it->second : nullptr;
+    if (!o || o->cls != k.cls) {
+        if (o) index_unlink(view_.by_class, o->cls, w.id);
+        index_link(view_.by_class, k.cls, w.id);
+    }
+    if (!o || o->workspace != k.workspace) {
+        if (o) index_unlink(view_.by_workspace, o->workspace, w.id);
+        index_link(view_.by_workspace, k.workspace, w.id);
+    }
+    if (!o || o->pid != k.pid) {
+        if (o) index_unlink(view_.by_pid, o->pid, w.id);
+        if (k.pid) index_link(view_.by_pid, k.pid, w.id);
+    }
+    if (!o || o->floating != k.floating) {
+        if (o) cow(view_.floating[o->floating]).erase(w.id);
+        cow(view_.floating[k.floating]).insert(w.id);
+    }
+    if (!o || o->fullscreen != k.fullscreen) {
+        if (o) cow(view_.fullscreen[o->fullscreen]).erase(w.id);
+        cow(view_.fullscreen[k.fullscreen]).insert(w.id);
+    }
+    keys_[w.id] = std::move(k);
+}
+
+void WindowIndex::remove(WindowID id) {
+    auto it = keys_.find(id);
+    if (it == keys_.end()) return;
+    const Key &k = it->second;
+    index_unlink(view_.by_class, k.cls, id);
+    index_unlink(view_.by_workspace, k.workspace, id);
+    index_unlink(view_.by_pid, k.pid, id);
+    cow(view_.floating[k.floating]).erase(id);
+    cow(view_.fullscreen[k.fullscreen]).erase(id);
+    keys_.erase(it);
+}
+
+const std::set<WindowID> *WindowIndex::View::lookup(const std::string &field, const std::string &value) const {
+    auto find = [](const auto &f, const auto &key) {
+        if (!f) return &none_;
+        auto it = f->find(key);
+        return it == f->end() ? &none_ : it->second.get();
+    };
+    bool flag = value=="true" || value=="1";
+    if (field=="class") return find(by_class, value);
+    if (field=="workspace") return find(by_workspace, atoi(value.c_str()));
+    if (field=="pid") return find(by_pid, (pid_t)atoi(value.c_str()));
+    if (field=="floating") return floating[flag] ? floating[flag].get() : &none_;
+    if (field=="fullscreen") return fullscreen[flag] ? fullscreen[flag].get() : &none_;
+    return nullptr;
+}
+
+// IPCServer implementation (skeleton)
+IPCServer::IPCServer(const std::string &sockpath): sockpath_(sockpath) {}
+IPCServer::~IPCServer() { stop(); }
+
+void IPCServer::start(CommandHandler handler) {
+    running_ = true;
+    // Create server socket
+    server_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server_fd_<0) return;
+    sockaddr_un addr; memset(&addr,0,sizeof(addr)); addr.sun_family = AF_UNIX; strncpy(addr.sun_path, sockpath_.c_str(), sizeof(addr.sun_path)-1);
+    unlink(sockpath_.c_str());
+    bind(server_fd_, (sockaddr*)&addr, sizeof(addr));
+    listen(server_fd_, 8);
+    accept_thread_ = std::thread(&IPCServer::accept_loop, this, handler);
+}
+
+void IPCServer::stop() {
+    running_ = false;
+    if (server_fd_>=0) close(server_fd_);
+    if (accept_thread_.joinable()) accept_thread_.join();
     // close all client fds
     std::lock_guard<std::mutex> lk(clients_mtx_);
     for (int fd : client_fds_) close(fd);
@@ -488,213 +2570,1985 @@ void IPCServer::accept_loop(CommandHandler handler) {
 }
 
 void IPCServer::handle_client(int client_fd, CommandHandler handler) {
-    // Simple loop: read lines and forward to handler
-    constexpr size_t BUF_SZ = 1024;
+    // Simple loop: read lines and forward to handler. Every complete line of one read() is
+    // queued before waiting for any reply, and the replies go out in a single write, so a
+    // pipelined batch costs one syscall each way and one main-loop wakeup.
+    constexpr size_t BUF_SZ = 16384;
     char buf[BUF_SZ];
     ssize_t r;
     std::string acc;
-    while ((r = read(client_fd, buf, BUF_SZ-1))>0) {
-        buf[r]=0; acc += buf;
+    TRACE_THREAD("ipc " + std::to_string(client_fd));
+    struct Reply { std::string tag, text; std::future<std::string> later; };
+    std::vector<Reply> replies;
+    auto reply = [&](const std::string &tag, const std::string &text) { replies.push_back(Reply{tag, text, {}}); };
+    auto flush_replies = [&]() {
+        std::string out;
+        for (Reply &rp : replies) {
+            std::string text = rp.text;
+            if (rp.later.valid()) {
+                try { text = rp.later.get(); }
+                catch (const std::future_error &) { text = "ERR shutting down"; } // job dropped unanswered
+            }
+            out += rp.tag + text + "\n";
+        }
+        replies.clear();
+        if (!out.empty()) write_reply(client_fd, out);
+    };
+    while ((r = read(client_fd, buf, BUF_SZ))>0) {
+        acc.append(buf, r);
         size_t pos;
         while ((pos = acc.find('\n'))!=std::string::npos) {
             std::string line = acc.substr(0,pos);
             acc.erase(0,pos+1);
             // Trim
             while(!line.empty() && (line.back()=='\r' || line.back()==' ')) line.pop_back();
-            if (!line.empty()) handler(line);
-            // reply quick OK
-            write(client_fd, "OK\n", 3);
+            std::string tag; // "#<id> " echoed in front of the reply
+            uint64_t id = 0;
+            if (!line.empty() && line[0]=='#') {
+                size_t sp = line.find(' ');
+                tag = line.substr(0, sp) + " ";
+                id = strtoull(line.c_str()+1, nullptr, 10);
+                line = sp == std::string::npos ? "" : line.substr(sp+1);
+            }
+            if (line=="state-fd") { // answered here: the reply carries the fd, not an OK
+                flush_replies();
+                int fd = state_fd_;
+                if (fd < 0 || !send_fds(client_fd, tag + "state-fd\n", {fd})) write_reply(client_fd, tag + "ERR no state page\n");
+                continue;
+            }
+            if (line=="event-ring") {
+                flush_replies();
+                if (!attach_ring_consumer(client_fd, tag)) write_reply(client_fd, tag + "ERR no event ring\n");
+                continue;
+            }
+            if (line=="subscribe" || line.compare(0, 10, "subscribe ")==0) { flush_replies(); subscribe(client_fd, line.substr(9)); continue; }
+            if (line=="ping") { reply(tag, "PONG"); continue; }
+            if (line.compare(0, 6, "query ")==0 && query_) {
+                flush_replies(); // earlier commands of the batch are answered, so the snapshot has them
+                reply(tag, query_(line.substr(6)));
+                continue;
+            }
+            if (line=="get-tree" && tree_) {
+                // streamed on this client's thread; event lines must not land inside the document
+                bool sub;
+                {
+                    std::lock_guard<std::mutex> lk(clients_mtx_);
+                    sub = subscribed(client_fd);
+                }
+                if (sub) { reply(tag, "ERR get-tree on a subscribed connection"); continue; }
+                flush_replies();
+                tree_(client_fd, tag);
+                continue;
+            }
+            if (line.empty()) { reply(tag, "OK"); continue; }
+            replies.push_back(Reply{tag, "", handler(line, client_fd, id)});
+        }
+        flush_replies();
+    }
+    if (on_disconnect_) on_disconnect_(client_fd);
+    // client disconnected -> remove from client list
+    {
+        std::lock_guard<std::mutex> lk(clients_mtx_);
+        client_fds_.erase(std::remove(client_fds_.begin(), client_fds_.end(), client_fd), client_fds_.end());
+        subscribers_.erase(std::remove(subscribers_.begin(), subscribers_.end(), client_fd), subscribers_.end());
+        bar_subscribers_.erase(std::remove(bar_subscribers_.begin(), bar_subscribers_.end(), client_fd), bar_subscribers_.end());
+        pending_.erase(client_fd);
+        auto rc = ring_consumers_.find(client_fd);
+        if (rc != ring_consumers_.end()) { close(rc->second); ring_consumers_.erase(rc); }
+    }
+    close(client_fd);
+}
+
+void IPCServer::emit_event(const WmEvent &ev) {
+    std::lock_guard<std::mutex> lk(clients_mtx_); // one lock orders seq, journal, ring and sockets
+    uint64_t seq = next_seq_++;
+    json j; j["event"] = ev.type; j["payload"] = ev.payload; j["seq"] = seq;
+    std::string line = j.dump()+"\n";
+    journal_.emplace_back(seq, line);
+    if (journal_.size() > JOURNAL_MAX) journal_.pop_front();
+    last_value_[ev.topic.empty() ? ev.type : ev.topic] = line;
+    if (ring_.ready()) {
+        uint16_t type = ev.type=="workspace" ? HWM_EV_WORKSPACE : ev.type=="focus" ? HWM_EV_FOCUS
+                      : ev.type=="bar-toggle" ? HWM_EV_BAR_TOGGLE : ev.type=="layout" ? HWM_EV_LAYOUT : HWM_EV_OTHER;
+        ring_.push(seq, type, ev.payload.dump());
+        ring_dirty_ = true;
+    }
+    send_to_clients(line);
+}
+
+void IPCServer::subscribe(int client_fd, const std::string &args) {
+    // subscribe: the last event of every topic, gathered into as few sends as possible, then the live stream
+    // subscribe since=<seq>: since=0 (or an aged-out / future seq) gets a snapshot first,
+    // any other seq gets exactly the journaled events after it
+    // subscribe format=lemonbar: the current bar line, then one line per bar change
+    if (args.find("format=lemonbar") != std::string::npos) {
+        std::lock_guard<std::mutex> lk(clients_mtx_);
+        if (!last_bar_line_.empty() && !queue(client_fd, last_bar_line_)) return;
+        if (std::find(bar_subscribers_.begin(), bar_subscribers_.end(), client_fd) == bar_subscribers_.end())
+            bar_subscribers_.push_back(client_fd);
+        return;
+    }
+    std::optional<uint64_t> since;
+    size_t p = args.find("since=");
+    if (p != std::string::npos) since = strtoull(args.c_str() + p + 6, nullptr, 10);
+    std::string snap;
+    uint64_t snap_seq = next_seq_ - 1;
+    auto need_snapshot = [&]() {
+        if (!since) return false;
+        std::lock_guard<std::mutex> lk(clients_mtx_);
+        uint64_t oldest = journal_.empty() ? next_seq_.load() : journal_.front().first;
+        return *since == 0 || *since + 1 < oldest || *since >= next_seq_;
+    };
+    if (need_snapshot() && snapshot_) {
+        // built before taking clients_mtx_ (the provider takes WM state locks); events racing
+        // with it are replayed below, which is harmless since events carry absolute state
+        json j; j["event"] = "snapshot"; j["payload"] = snapshot_(); j["seq"] = snap_seq;
+        snap = j.dump()+"\n";
+        since = snap_seq;
+    }
+    std::lock_guard<std::mutex> lk(clients_mtx_);
+    std::vector<iovec> iov;
+    if (!since) for (auto &p : last_value_) iov.push_back(iovec{(void*)p.second.data(), p.second.size()});
+    std::string out = snap;
+    if (since) for (auto &e : journal_) if (e.first > *since) out += e.second;
+    iov.push_back(iovec{(void*)out.data(), out.size()});
+    if (!queue(client_fd, std::move(iov))) return;
+    if (std::find(subscribers_.begin(), subscribers_.end(), client_fd) == subscribers_.end())
+        subscribers_.push_back(client_fd);
+}
+
+void IPCServer::emit_bar_line(const std::string &line) {
+    TRACE_SPAN("ipc fanout bar");
+    std::lock_guard<std::mutex> lk(clients_mtx_);
+    last_bar_line_ = line;
+    std::vector<int> fds = bar_subscribers_; // queue() may drop one
+    for (int fd : fds) queue(fd, line);
+}
+
+bool IPCServer::attach_ring_consumer(int client_fd, const std::string &tag) {
+    std::lock_guard<std::mutex> lk(clients_mtx_);
+    int efd = -1;
+    if (ring_.ready() || ring_.create(next_seq_)) efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd < 0 || !send_fds(client_fd, tag + "event-ring\n", {ring_.reader_fd(), efd})) {
+        if (efd >= 0) close(efd);
+        return false;
+    }
+    auto old = ring_consumers_.find(client_fd);
+    if (old != ring_consumers_.end()) close(old->second);
+    ring_consumers_[client_fd] = efd;
+    return true;
+}
+
+void IPCServer::notify_ring() {
+    std::lock_guard<std::mutex> lk(clients_mtx_);
+    if (!ring_dirty_) return;
+    ring_dirty_ = false;
+    uint64_t one = 1;
+    for (auto &p : ring_consumers_) { ssize_t r = write(p.second, &one, sizeof(one)); (void)r; }
+}
+
+void IPCServer::send_to_clients(const std::string &s) {
+    TRACE_SPAN("ipc fanout");
+    std::vector<int> fds = subscribers_; // queue() may drop one
+    for (int fd : fds) queue(fd, s);
+}
+
+bool IPCServer::queue(int fd, std::vector<iovec> iov) {
+    // whatever is still pending goes out first, so the stream stays in order
+    std::string old;
+    auto pit = pending_.find(fd);
+    if (pit != pending_.end()) { old = std::move(pit->second); pending_.erase(pit); }
+    if (!old.empty()) iov.insert(iov.begin(), iovec{(void*)old.data(), old.size()});
+    size_t total = 0;
+    for (const iovec &v : iov) total += v.iov_len;
+    bool alive = send_iov(fd, iov, MSG_DONTWAIT);
+    std::string rest;
+    for (const iovec &v : iov) rest.append((const char*)v.iov_base, v.iov_len);
+    fanout_bytes_.add(total - rest.size());
+    if (alive && rest.size() <= PENDING_MAX) {
+        if (!rest.empty()) pending_[fd] = std::move(rest);
+        return true;
+    }
+    drop_subscriber(fd);
+    return false;
+}
+
+void IPCServer::drop_subscriber(int fd) {
+    // its reader thread sees EOF and cleans the connection up as for any disconnect
+    subscribers_.erase(std::remove(subscribers_.begin(), subscribers_.end(), fd), subscribers_.end());
+    bar_subscribers_.erase(std::remove(bar_subscribers_.begin(), bar_subscribers_.end(), fd), bar_subscribers_.end());
+    pending_.erase(fd);
+    shutdown(fd, SHUT_RDWR);
+    dropped_.add();
+}
+
+bool IPCServer::subscribed(int fd) {
+    return std::find(subscribers_.begin(), subscribers_.end(), fd) != subscribers_.end()
+        || std::find(bar_subscribers_.begin(), bar_subscribers_.end(), fd) != bar_subscribers_.end();
+}
+
+void IPCServer::write_reply(int fd, const std::string &s) {
+    {
+        std::lock_guard<std::mutex> lk(clients_mtx_);
+        if (subscribed(fd) || pending_.count(fd)) { queue(fd, s); return; } // after the events queued for it
+    }
+    ssize_t w = write(fd, s.data(), s.size()); (void)w; // the client's own thread: may block
+}
+
+void IPCServer::flush_pending() {
+    std::lock_guard<std::mutex> lk(clients_mtx_);
+    std::vector<int> fds;
+    for (auto &p : pending_) fds.push_back(p.first);
+    for (int fd : fds) queue(fd, std::vector<iovec>());
+}
+
+bool IPCServer::has_pending() {
+    std::lock_guard<std::mutex> lk(clients_mtx_);
+    return !pending_.empty();
+}
+
+// EventRing implementation
+EventRing::~EventRing() {
+    if (ring_) munmap(ring_, bytes_);
+    if (ro_fd_ >= 0) close(ro_fd_);
+    if (fd_ >= 0) close(fd_);
+}
+bool EventRing::create(uint64_t first_seq, uint32_t nslots) {
+    if (nslots & (nslots - 1)) return false; // power of two: index = seq & (nslots-1)
+    void *map = nullptr;
+    bytes_ = sizeof(hwm_ring_t) + size_t(nslots) * sizeof(hwm_ring_slot_t);
+    fd_ = create_shm("hibriwm-events", bytes_, &map);
+    if (fd_ < 0) return false;
+    ring_ = (hwm_ring_t*)map;
+    ring_->magic = HIBRIWM_RING_MAGIC; ring_->version = HIBRIWM_RING_VERSION; ring_->nslots = nslots;
+    ring_->head = first_seq; // ring and socket events share sequence numbers
+    ro_fd_ = reopen_readonly(fd_);
+    if (ro_fd_ >= 0) return true;
+    // no read-only fd to hand out: readers could never map it, so do not keep it either
+    munmap(ring_, bytes_); close(fd_);
+    ring_ = nullptr; fd_ = -1;
+    return false;
+}
+void EventRing::push(uint64_t seq, uint16_t type, const std::string &payload) {
+    hwm_ring_slot_t &s = ring_->slots[seq & (ring_->nslots - 1)];
+    __atomic_store_n(&s.seq, 0, __ATOMIC_RELAXED); // readers copying this slot now will retry
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    timespec ts; clock_gettime(CLOCK_MONOTONIC, &ts);
+    s.time_ns = uint64_t(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+    s.type = type;
+    s.len = (uint16_t)std::min<size_t>(payload.size(), HWM_RING_PAYLOAD);
+    s.flags = payload.size() > HWM_RING_PAYLOAD ? HWM_SLOT_TRUNCATED : 0;
+    memcpy(s.data, payload.data(), s.len);
+    __atomic_store_n(&s.seq, seq + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring_->head, seq + 1, __ATOMIC_RELEASE);
+}
+
+// FlightRecorder implementation
+FlightRecorder::~FlightRecorder() {
+    if (f_) munmap(f_, bytes_);
+}
+bool FlightRecorder::open(const std::string &path, uint32_t nrecs) {
+    if (nrecs & (nrecs - 1)) return false; // power of two: slot = index & (nrecs-1)
+    rename(path.c_str(), (path + ".old").c_str()); // keep the record of the previous run
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return false;
+    bytes_ = sizeof(hwm_flight_t) + size_t(nrecs) * sizeof(hwm_flight_rec_t);
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, bytes_) == 0) map = mmap(nullptr, bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file
+    if (map == MAP_FAILED) return false;
+    hwm_flight_t *f = (hwm_flight_t*)map;
+    f->version = HIBRIWM_FLIGHT_VERSION; f->nrecs = nrecs; f->pid = getpid();
+    f->mono_ns = hwm_flight_clock(CLOCK_MONOTONIC); f->real_ns = hwm_flight_clock(CLOCK_REALTIME);
+    __atomic_store_n(&f->magic, HIBRIWM_FLIGHT_MAGIC, __ATOMIC_RELEASE); // last: the header is complete
+    f_ = f;
+    return true;
+}
+
+// InputManager skeleton
+InputManager::InputManager(XConnection &xc, IPCServer &ipc): xc_(xc), ipc_(ipc) {}
+InputManager::~InputManager() {}
+void InputManager::register_default_bindings() {
+    // Example
+    bind_key("Mod4-Return","spawn st");
+}
+// Key names: printable ASCII stands for itself (letters in lower case), plus these and F1..F35
+static const std::pair<const char*, uint32_t> KEYSYM_NAMES[] = {
+    {"Return", 0xff0d}, {"Escape", 0xff1b}, {"Tab", 0xff09}, {"BackSpace", 0xff08}, {"Delete", 0xffff},
+    {"space", 0x20}, {"minus", 0x2d}, {"Home", 0xff50}, {"Left", 0xff51}, {"Up", 0xff52}, {"Right", 0xff53},
+    {"Down", 0xff54}, {"Prior", 0xff55}, {"Next", 0xff56}, {"End", 0xff57}, {"Print", 0xff61}, {"Insert", 0xff63}};
+static const std::pair<const char*, uint16_t> MOD_NAMES[] = {
+    {"Shift", XCB_MOD_MASK_SHIFT}, {"Ctrl", XCB_MOD_MASK_CONTROL}, {"Mod1", XCB_MOD_MASK_1},
+    {"Mod3", XCB_MOD_MASK_3}, {"Mod4", XCB_MOD_MASK_4}, {"Mod5", XCB_MOD_MASK_5}};
+static uint32_t keysym_from_name(const std::string &n) {
+    for (auto &k : KEYSYM_NAMES) if (n == k.first) return k.second;
+    if (n.size() > 1 && n[0] == 'F' && isdigit((unsigned char)n[1])) { int f = atoi(n.c_str() + 1); if (f >= 1 && f <= 35) return 0xffbd + f; }
+    if (n.size() == 1 && n[0] > 0x20 && n[0] < 0x7f) return (uint32_t)tolower((unsigned char)n[0]);
+    return 0;
+}
+static std::string keysym_name(uint32_t ks) {
+    for (auto &k : KEYSYM_NAMES) if (ks == k.second) return k.first;
+    if (ks >= 0xffbe && ks <= 0xffe0) return "F" + std::to_string(ks - 0xffbd);
+    if (ks > 0x20 && ks < 0x7f) return std::string(1, (char)ks);
+    return "";
+}
+// Parses "Mod4-Shift-Return" (also Control, Alt = Mod1, Super = Mod4); Lock and Mod2 (NumLock) never count
+static bool parse_combo(const std::string &combo, uint16_t &mods, uint32_t &ks) {
+    mods = 0; ks = 0;
+    size_t start = 0, dash;
+    while ((dash = combo.find('-', start)) != std::string::npos && dash + 1 < combo.size()) {
+        std::string m = combo.substr(start, dash - start);
+        if (m == "Control") m = "Ctrl"; else if (m == "Alt") m = "Mod1"; else if (m == "Super") m = "Mod4";
+        auto it = std::find_if(std::begin(MOD_NAMES), std::end(MOD_NAMES), [&](auto &p) { return m == p.first; });
+        if (it == std::end(MOD_NAMES)) return false;
+        mods |= it->second;
+        start = dash + 1;
+    }
+    ks = keysym_from_name(combo.substr(start));
+    return ks != 0;
+}
+static std::string combo_name(uint16_t mods, uint32_t ks) {
+    std::string s;
+    for (auto &m : MOD_NAMES) if (mods & m.second) { s += m.first; s += '-'; }
+    return s + keysym_name(ks);
+}
+bool InputManager::valid_combo(const std::string &keycombo) {
+    uint16_t mods; uint32_t ks;
+    return parse_combo(keycombo, mods, ks);
+}
+void InputManager::load_keymap() {
+    xcb_connection_t *c = xc_.conn();
+    const xcb_setup_t *setup = xcb_get_setup(c);
+    min_keycode_ = setup->min_keycode;
+    keysyms_.clear();
+    xc_.round_trip();
+    xcb_get_keyboard_mapping_reply_t *r = xcb_get_keyboard_mapping_reply(c, xc_.sent(xcb_get_keyboard_mapping(c, setup->min_keycode, setup->max_keycode - setup->min_keycode + 1)), nullptr);
+    if (!r) return;
+    const xcb_keysym_t *ks = xcb_get_keyboard_mapping_keysyms(r);
+    int per = r->keysyms_per_keycode, n = xcb_get_keyboard_mapping_keysyms_length(r);
+    for (int i = 0; per && i + per <= n; i += per) keysyms_.push_back(ks[i]);
+    free(r);
+}
+void InputManager::grab(const std::string &combo) {
+    uint16_t mods; uint32_t ks;
+    if (!parse_combo(combo, mods, ks)) return;
+    for (size_t i = 0; i < keysyms_.size(); i++)
+        if (keysyms_[i] == ks) xc_.grab_key(uint16_t(min_keycode_ + i), mods);
+}
+void InputManager::bind_key(const std::string &keycombo, const std::string &cmd) {
+    uint16_t mods; uint32_t ks;
+    if (!parse_combo(keycombo, mods, ks)) { std::cerr << "bind: bad key combo " << keycombo << "\n"; return; }
+    if (keysyms_.empty()) { XConnection::Op op(xc_, "keymap", XConnection::Op::WAITS); load_keymap(); }
+    std::string name = combo_name(mods, ks);
+    if (!keymap_.count(name)) grab(name);
+    keymap_[name] = cmd;
+    xcb_flush(xc_.conn());
+}
+void InputManager::bind_button(const std::string &btncombo, const std::string &cmd){ btnmap_[btncombo]=cmd; }
+void InputManager::refresh_keymap() {
+    xc_.sent(xcb_ungrab_key(xc_.conn(), XCB_GRAB_ANY, xc_.root(), XCB_MOD_MASK_ANY));
+    load_keymap();
+    for (auto &b : keymap_) grab(b.first);
+    xcb_flush(xc_.conn());
+}
+void InputManager::handle_key_event(xcb_key_press_event_t *ev) {
+    size_t i = size_t(ev->detail) - min_keycode_;
+    if (ev->detail < min_keycode_ || i >= keysyms_.size()) return;
+    uint16_t mods = ev->state & (XCB_MOD_MASK_SHIFT | XCB_MOD_MASK_CONTROL | XCB_MOD_MASK_1 | XCB_MOD_MASK_3 | XCB_MOD_MASK_4 | XCB_MOD_MASK_5);
+    run_binding(combo_name(mods, keysyms_[i]));
+}
+void InputManager::run_binding(const std::string &combo) {
+    if (!dispatch_) return;
+    auto it = keymap_.find(combo);
+    if (it != keymap_.end()) { dispatch_(it->second); return; }
+    auto bt = btnmap_.find(combo);
+    if (bt != btnmap_.end()) dispatch_(bt->second);
+}
+void InputManager::handle_button_event(xcb_button_press_event_t *ev) {
+    // TODO: translate button -> btncombo and handle
+}
+
+// ConfigLoader skeleton
+ConfigLoader::ConfigLoader(const std::string &path, IPCServer &ipc): path_(path), ipc_(ipc) {}
+ConfigLoader::~ConfigLoader() { stop(); }
+void ConfigLoader::run_once() {
+    // Execute the shell config script and pipe lines to the IPC socket (or directly call handler)
+    if (!fs::exists(path_)) return;
+    TRACE_THREAD("config");
+    TRACE_SPAN_D("config reload", path_);
+    std::string cmd = "/bin/sh '" + path_ + "'";
+    // For simplicity we'll run the script and read its stdout which should contain "COMMAND lines"
+    FILE *p = popen(cmd.c_str(), "r");
+    if (!p) return;
+    // one connection for the whole script, commands pipelined (replies are not awaited)
+    HwmClient client;
+    bool connected = client.connect();
+    if (connected) client.send("client-class config"); // ahead of IPC clients, behind input
+    char buf[512];
+    while (fgets(buf, sizeof(buf), p)) {
+        std::string line(buf);
+        while (!line.empty() && (line.back()=='\n' || line.back()=='\r')) line.pop_back();
+        if (!line.empty() && connected) client.send(line);
+    }
+    pclose(p);
+    if (connected) client.drain();
+}
+
+void ConfigLoader::watch(std::function<void()> reload_callback) {
+    watching_ = true;
+    inotify_fd_ = inotify_init1(IN_NONBLOCK);
+    if (inotify_fd_ < 0) return;
+    int wd = inotify_add_watch(inotify_fd_, path_.c_str(), IN_MODIFY | IN_CLOSE_WRITE);
+    watch_thread_ = std::thread([this, reload_callback, wd]() {
+        constexpr size_t BUF=1024;
+        char buf[BUF];
+        while (watching_) {
+            ssize_t len = read(inotify_fd_, buf, BUF);
+            if (len>0) {
+                // naive: any event triggers reload
+                reload_callback();
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        }
+        if (wd>=0) inotify_rm_watch(inotify_fd_, wd);
+        close(inotify_fd_);
+    });
+}
+
+void ConfigLoader::reload() {
+    std::lock_guard<std::mutex> lk(reload_mtx_);
+    if (stopped_) return;
+    reload_pending_ = true;
+    if (reload_thread_.joinable()) { reload_cv_.notify_one(); return; }
+    reload_thread_ = std::thread([this]() {
+        std::unique_lock<std::mutex> lk(reload_mtx_);
+        for (;;) {
+            reload_cv_.wait(lk, [this] { return reload_pending_ || stopped_; });
+            if (stopped_) return;
+            reload_pending_ = false;
+            lk.unlock();
+            run_once();
+            lk.lock();
+        }
+    });
+}
+
+void ConfigLoader::stop() {
+    {
+        std::lock_guard<std::mutex> lk(reload_mtx_);
+        stopped_ = true;
+    }
+    reload_cv_.notify_one();
+    watching_ = false;
+    if (watch_thread_.joinable()) watch_thread_.join();
+    if (reload_thread_.joinable()) reload_thread_.join();
+}
+
+// StatePage implementation
+StatePage::~StatePage() {
+    if (page_) munmap(page_, sizeof(hwm_state_page_t));
+    if (ro_fd_ >= 0) close(ro_fd_);
+    if (fd_ >= 0) close(fd_);
+}
+bool StatePage::create() {
+    void *map = nullptr;
+    fd_ = create_shm("hibriwm-state", sizeof(hwm_state_page_t), &map);
+    if (fd_ < 0) return false;
+    page_ = (hwm_state_page_t*)map;
+    page_->magic = HIBRIWM_STATE_MAGIC;
+    page_->version = HIBRIWM_STATE_VERSION;
+    ro_fd_ = reopen_readonly(fd_);
+    return ro_fd_ >= 0;
+}
+void StatePage::publish(const hwm_state_t &st) {
+    if (!page_ || memcmp(&page_->state, &st, sizeof(st)) == 0) return;
+    uint64_t seq = __atomic_load_n(&page_->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&page_->seq, seq + 1, __ATOMIC_RELAXED); // odd: readers retry
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&page_->state, &st, sizeof(st));
+    __atomic_store_n(&page_->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// NativeBar implementation
+NativeBar::NativeBar(XConnection &xc): xc_(xc) {}
+NativeBar::~NativeBar() { destroy(); }
+bool NativeBar::create(const std::map<int, Monitor> &monitors) {
+    if (active()) return true;
+    xcb_connection_t *c = xc_.conn();
+    font_ = xcb_generate_id(c);
+    xc_.sent(xcb_open_font(c, font_, 5, "fixed"));
+    xc_.round_trip();
+    xcb_query_font_reply_t *fi = xcb_query_font_reply(c, xc_.sent(xcb_query_font(c, font_)), nullptr); // once, at creation
+    if (!fi) return false;
+    char_w_ = fi->max_bounds.character_width; ascent_ = fi->font_ascent;
+    height_ = fi->font_ascent + fi->font_descent + 6;
+    free(fi);
+    xcb_atom_t type = xc_.atom("_NET_WM_WINDOW_TYPE"), dock = xc_.atom("_NET_WM_WINDOW_TYPE_DOCK");
+    xcb_atom_t strut = xc_.atom("_NET_WM_STRUT_PARTIAL");
+    for (auto &p : monitors) {
+        const Geometry &g = p.second.screen;
+        Bar b; b.geom = Geometry{g.x, g.y, g.w, height_};
+        b.win = xcb_generate_id(c);
+        uint32_t vals[] = {bg_, 1, XCB_EVENT_MASK_EXPOSURE}; // back pixel, override-redirect, events
+        xc_.sent(xcb_create_window(c, XCB_COPY_FROM_PARENT, b.win, xc_.root(), g.x, g.y, g.w, height_, 0,
+                          XCB_WINDOW_CLASS_INPUT_OUTPUT, XCB_COPY_FROM_PARENT,
+                          XCB_CW_BACK_PIXEL | XCB_CW_OVERRIDE_REDIRECT | XCB_CW_EVENT_MASK, vals));
+        xc_.sent(xcb_change_property(c, XCB_PROP_MODE_REPLACE, b.win, type, XCB_ATOM_ATOM, 32, 1, &dock));
+        uint32_t sp[12] = {0, 0, (uint32_t)height_, 0, 0, 0, 0, 0, (uint32_t)g.x, (uint32_t)(g.x + g.w - 1), 0, 0};
+        xc_.sent(xcb_change_property(c, XCB_PROP_MODE_REPLACE, b.win, strut, XCB_ATOM_CARDINAL, 32, 12, sp));
+        b.gc = xcb_generate_id(c);
+        uint32_t gcv[] = {fg_, bg_, font_};
+        xc_.sent(xcb_create_gc(c, b.gc, b.win, XCB_GC_FOREGROUND | XCB_GC_BACKGROUND | XCB_GC_FONT, gcv));
+        if (visible_) xc_.sent(xcb_map_window(c, b.win));
+        bars_.push_back(std::move(b));
+    }
+    xcb_flush(c);
+    return true;
+}
+void NativeBar::destroy() {
+    xcb_connection_t *c = xc_.conn();
+    if (!c) return;
+    for (Bar &b : bars_) { xc_.sent(xcb_free_gc(c, b.gc)); xc_.sent(xcb_destroy_window(c, b.win)); }
+    if (font_) xc_.sent(xcb_close_font(c, font_));
+    bars_.clear(); font_ = 0;
+    xcb_flush(c);
+}
+void NativeBar::set_visible(bool visible) {
+    if (visible == visible_) return;
+    visible_ = visible;
+    for (Bar &b : bars_) {
+        if (visible) { xc_.sent(xcb_map_window(xc_.conn(), b.win)); b.damaged = true; }
+        else xc_.sent(xcb_unmap_window(xc_.conn(), b.win));
+    }
+    if (visible) update(cells_, title_, layout_);
+    else xcb_flush(xc_.conn());
+}
+void NativeBar::set_colors(const std::string &fg, const std::string &bg) {
+    fg_ = color_pixel(fg); bg_ = color_pixel(bg);
+    for (Bar &b : bars_) b.damaged = true;
+}
+void NativeBar::update(const std::vector<BarCell> &cells, const std::string &title, const std::string &layout) {
+    cells_ = cells; title_ = title; layout_ = layout;
+    if (!visible_) return; // painted from scratch when shown again
+    for (Bar &b : bars_) paint(b);
+    xcb_flush(xc_.conn());
+}
+void NativeBar::expose(xcb_window_t win) {
+    for (Bar &b : bars_) if (b.win == win) { b.damaged = true; paint(b); }
+    xcb_flush(xc_.conn());
+}
+void NativeBar::fill(Bar &b, int x, int w, uint32_t color) {
+    if (w <= 0) return;
+    xc_.sent(xcb_change_gc(xc_.conn(), b.gc, XCB_GC_FOREGROUND, &color));
+    xcb_rectangle_t r{(int16_t)x, 0, (uint16_t)w, (uint16_t)height_};
+    xc_.sent(xcb_poly_fill_rectangle(xc_.conn(), b.win, b.gc, 1, &r));
+}
+void NativeBar::text(Bar &b, int x, const std::string &s, uint32_t fg, uint32_t bg) {
+    uint32_t v[] = {fg, bg};
+    xc_.sent(xcb_change_gc(xc_.conn(), b.gc, XCB_GC_FOREGROUND | XCB_GC_BACKGROUND, v));
+    size_t n = std::min<size_t>(s.size(), 255); // ImageText8 limit
+    xc_.sent(xcb_image_text_8(xc_.conn(), n, b.win, b.gc, x, (height_ - ascent_) / 2 + ascent_ - 1, s.c_str()));
+}
+void NativeBar::paint(Bar &b) {
+    // left: workspace cells. A cell is repainted when it changed; once the widths differ,
+    // everything to its right shifts and is repainted too, including the title.
+    int x = 0, old_end = 0;
+    for (auto &c : b.cells) old_end += cell_width(c);
+    bool shifted = b.damaged;
+    for (size_t i=0;i<cells_.size();++i) {
+        const BarCell &c = cells_[i];
+        bool same = !shifted && i < b.cells.size() && b.cells[i].label == c.label && b.cells[i].color == c.color;
+        if (!same) {
+            shifted = shifted || i >= b.cells.size() || b.cells[i].label.size() != c.label.size();
+            uint32_t bg = color_pixel(c.color);
+            fill(b, x, cell_width(c), bg);
+            text(b, x + char_w_, c.label, fg_, bg);
+        }
+        x += cell_width(c);
+    }
+    int left_end = x;
+    shifted = shifted || b.cells.size() != cells_.size();
+    if (left_end < old_end) fill(b, left_end, old_end - left_end, bg_);
+    // right: layout name
+    int lw = int(layout_.size() + 2) * char_w_, right_start = b.geom.w - lw;
+    bool layout_moved = b.layout.size() != layout_.size();
+    if (b.damaged || layout_ != b.layout) {
+        int old_lw = int(b.layout.size() + 2) * char_w_;
+        fill(b, b.geom.w - std::max(lw, old_lw), std::max(lw, old_lw), bg_);
+        text(b, right_start + char_w_, layout_, fg_, bg_);
+    }
+    // center: title, clipped to the space between the two
+    if (b.damaged || shifted || layout_moved || title_ != b.title) {
+        fill(b, left_end, right_start - left_end, bg_);
+        int room = std::max(0, (right_start - left_end) / char_w_ - 2);
+        std::string t = title_.substr(0, room);
+        int tx = std::max(left_end + char_w_, (b.geom.w - int(t.size()) * char_w_) / 2);
+        text(b, tx, t, fg_, bg_);
+    }
+    b.cells = cells_; b.title = title_; b.layout = layout_;
+    b.damaged = false;
+}
+
+// BarPublisher skeleton
+BarPublisher::BarPublisher(IPCServer &ipc): ipc_(ipc) {}
+BarPublisher::~BarPublisher() {}
+void BarPublisher::publish_workspace(int current, const std::vector<int> &occupied) {
+    WmEvent e; e.type = "workspace"; e.payload["index"] = current; e.payload["occupied"] = occupied;
+    stage(std::move(e));
+}
+void BarPublisher::publish_focus(WindowID id, const std::string &title) {
+    WmEvent e; e.type = "focus"; e.payload["win"] = id; e.payload["title"] = title;
+    stage(std::move(e));
+}
+void BarPublisher::publish_bar_visible(bool visible) {
+    WmEvent e; e.type = "bar-toggle"; e.payload["visible"] = visible;
+    stage(std::move(e));
+}
+void BarPublisher::publish_layout(int monitor, int ws, const std::string &name) {
+    WmEvent e; e.type = "layout"; e.topic = "layout:" + std::to_string(monitor);
+    e.payload["monitor"] = monitor; e.payload["workspace"] = ws; e.payload["name"] = name;
+    stage(std::move(e));
+}
+void BarPublisher::stage(WmEvent e) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    Topic &t = topics_[e.topic.empty() ? e.type : e.topic];
+    t.dirty = e.payload != t.last_sent;
+    t.staged = std::move(e);
+}
+std::optional<BarPublisher::Clock::time_point> BarPublisher::flush(Clock::time_point now) {
+    std::vector<WmEvent> out;
+    std::string line;
+    std::optional<Clock::time_point> next;
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        for (auto &p : topics_) {
+            Topic &t = p.second;
+            if (!t.dirty) continue;
+            Clock::time_point due = t.last + interval_;
+            if (now < due) { if (!next || due < *next) next = due; continue; }
+            t.dirty = false; t.last = now; t.last_sent = t.staged.payload;
+            out.push_back(t.staged);
+        }
+        for (auto &e : out) {
+            const json &p = e.payload;
+            if (e.type=="workspace") { model_.current = p["index"]; model_.occupied = p["occupied"].get<std::vector<int>>(); }
+            else if (e.type=="focus") model_.title = p["title"];
+            else if (e.type=="bar-toggle") model_.visible = p["visible"];
+            else if (e.type=="layout" && p["workspace"] == model_.current) model_.layout = p["name"];
+            render_dirty_ = true;
+        }
+        if (render_dirty_) {
+            line = render_line();
+            if (native_) native_->update(cells(), model_.title, model_.layout);
+            render_dirty_ = false;
+        }
+    }
+    for (auto &e : out) ipc_.emit_event(e); // outside mtx_: emit_event takes the IPC lock
+    if (!line.empty()) ipc_.emit_bar_line(line);
+    return next;
+}
+bool BarPublisher::set_format_option(const std::string &key, const std::string &value) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    if (key=="format") fmt_.format = value;
+    else if (key=="color-active") fmt_.active = hex_color_sanitize(value);
+    else if (key=="color-occupied") fmt_.occupied = hex_color_sanitize(value);
+    else if (key=="color-empty") fmt_.empty = hex_color_sanitize(value);
+    else if (key=="show-occupied-only") fmt_.occupied_only = value=="true" || value=="1";
+    else if (key=="title-max") fmt_.title_max = (size_t)std::max(0, atoi(value.c_str()));
+    else return false;
+    render_dirty_ = true;
+    return true;
+}
+void BarPublisher::set_workspace_names(const std::map<int, std::string> &names) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    model_.names = names;
+    render_dirty_ = true;
+}
+std::vector<BarCell> BarPublisher::cells() {
+    std::map<int, std::string> names = model_.names;
+    if (names.empty()) { // no set-workspaces: show what exists
+        for (int i : model_.occupied) names[i] = std::to_string(i);
+        if (model_.current) names[model_.current] = std::to_string(model_.current);
+    }
+    std::vector<BarCell> out;
+    for (auto &p : names) {
+        bool occ = std::find(model_.occupied.begin(), model_.occupied.end(), p.first) != model_.occupied.end();
+        bool act = p.first == model_.current;
+        if (fmt_.occupied_only && !occ && !act) continue;
+        out.push_back(BarCell{p.second, act ? fmt_.active : occ ? fmt_.occupied : fmt_.empty});
+    }
+    return out;
+}
+std::string BarPublisher::render_line() {
+    if (!model_.visible) return "\n"; // lemonbar keeps its window; an empty line clears it
+    auto escape = [](const std::string &s) { // '%' starts a lemonbar formatting block
+        std::string o;
+        for (char c : s) { if (c=='%') o += '%'; o += c; }
+        return o;
+    };
+    std::string ws_cells;
+    for (const BarCell &c : cells()) ws_cells += "%{B" + c.color + "} " + escape(c.label) + " %{B-}";
+    std::string title;
+    size_t chars = 0;
+    for (size_t i=0;i<model_.title.size();++i) {
+        unsigned char c = model_.title[i];
+        if ((c & 0xC0) != 0x80 && chars++ == fmt_.title_max) { title += "…"; break; }
+        title += (char)c;
+    }
+    std::string out = fmt_.format;
+    auto subst = [&out](const std::string &key, const std::string &val) {
+        for (size_t p = out.find(key); p != std::string::npos; p = out.find(key, p + val.size()))
+            out.replace(p, key.size(), val);
+    };
+    subst("{workspaces}", ws_cells);
+    subst("{title}", escape(title));
+    subst("{layout}", escape(model_.layout));
+    return out + "\n";
+}
+
+// CommandScheduler implementation
+CommandScheduler::CommandScheduler() {
+    for (int c = 0; c < CMD_CLASSES; c++) {
+        std::string lb = std::string("class=\"") + CLASS_NAMES[c] + "\"";
+        metrics().attach("hibriwm_command_wait_microseconds", "Time a command spent queued before running", lb, wait_[c]);
+        metrics().sampled("hibriwm_command_queue_depth", "Commands queued", lb, [this, c]() { return (double)depth((CommandClass)c); });
+    }
+}
+bool CommandScheduler::push(CommandClass cls, int client, Job job) {
+    std::unique_lock<std::mutex> lk(mtx_);
+    if (closed_) {
+        std::string reply = close_reply_;
+        lk.unlock();
+        job.done.set_value(reply);
+        return false;
+    }
+    if (cls == CMD_IPC && client) {
+        auto now = Clock::now();
+        auto it = buckets_.find(client);
+        if (it == buckets_.end()) it = buckets_.emplace(client, Bucket{burst_, now}).first;
+        Bucket &b = it->second;
+        b.tokens = std::min(burst_, b.tokens + rate_ * std::chrono::duration<double>(now - b.last).count());
+        b.last = now;
+        if (b.tokens < 1) {
+            rejected_.add();
+            lk.unlock();
+            job.done.set_value("ERR rate limited");
+            return false;
+        }
+        b.tokens -= 1;
+    }
+    Queue &q = queues_[cls];
+    std::deque<Job> &mine = q.per_client[client];
+    if (mine.empty()) q.turn.push_back(client);
+    mine.push_back(std::move(job));
+    depth_[cls]++;
+    return true;
+}
+
+bool CommandScheduler::pop(CommandClass cls, Job &out) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    Queue &q = queues_[cls];
+    if (q.turn.empty()) return false;
+    int client = q.turn.front();
+    q.turn.pop_front();
+    auto it = q.per_client.find(client);
+    out = std::move(it->second.front());
+    it->second.pop_front();
+    if (it->second.empty()) q.per_client.erase(it);
+    else q.turn.push_back(client); // one job per client per turn
+    depth_[cls]--;
+    return true;
+}
+
+bool CommandScheduler::run(std::chrono::microseconds budget) {
+    auto start = Clock::now();
+    Job job;
+    for (int c = CMD_INPUT; c < CMD_CLASSES; c++) {
+        while (pop((CommandClass)c, job)) {
+            auto now = Clock::now();
+            wait_[c].record(std::chrono::duration_cast<std::chrono::microseconds>(now - job.queued).count());
+            if (flight_) flight_->record(HWM_FL_COMMAND, job.req_id, c, job.line);
+            TRACE_COMMAND(job.req_id);
+            TRACE_SPAN_D("command", job.line);
+            running_.store(&job, std::memory_order_relaxed);
+            result_ = "OK";
+            job.run();
+            running_.store(nullptr, std::memory_order_relaxed);
+            ran_.emplace_back(std::move(job.done), std::move(result_));
+            if (closed_) return false;
+            if (c == CMD_INPUT) continue;
+            if (Clock::now() - start >= budget) return depth(CMD_CONFIG) || depth(CMD_IPC) || depth(CMD_INPUT);
+            if (depth(CMD_INPUT)) { c = CMD_INPUT - 1; break; } // input queued meanwhile goes first
         }
     }
-    // client disconnected -> remove from client list
+    return false;
+}
+
+void CommandScheduler::close(const std::string &reply) {
+    std::vector<Job> dropped;
     {
-        std::lock_guard<std::mutex> lk(clients_mtx_);
-        client_fds_.erase(std::remove(client_fds_.begin(), client_fds_.end(), client_fd), client_fds_.end());
+        std::lock_guard<std::mutex> lk(mtx_);
+        closed_ = true;
+        close_reply_ = reply;
+        for (int c = CMD_INPUT; c < CMD_CLASSES; c++) {
+            for (auto &p : queues_[c].per_client) for (Job &j : p.second) dropped.push_back(std::move(j));
+            queues_[c] = Queue();
+            depth_[c] = 0;
+        }
     }
-    close(client_fd);
+    for (Job &j : dropped) j.done.set_value(reply);
 }
 
-void IPCServer::emit_event(const WmEvent &ev) {
-    json j; j["event"] = ev.type; j["payload"] = ev.payload;
-    send_to_clients(j.dump()+"\n");
+void CommandScheduler::answer() {
+    for (auto &r : ran_) r.first.set_value(r.second);
+    ran_.clear();
 }
 
-void IPCServer::send_to_clients(const std::string &s) {
-    std::lock_guard<std::mutex> lk(clients_mtx_);
-    for (int fd : client_fds_) {
-        ssize_t r = write(fd, s.c_str(), s.size()); (void)r;
-    }
+void CommandScheduler::set_rate(double per_sec, double burst) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    rate_ = std::max(1.0, per_sec);
+    burst_ = std::max(1.0, burst);
 }
 
-// InputManager skeleton
-InputManager::InputManager(XConnection &xc, IPCServer &ipc): xc_(xc), ipc_(ipc) {}
-InputManager::~InputManager() {}
-void InputManager::register_default_bindings() {
-    // Example
-    bind_key("Mod4-Return","spawn st");
-}
-void InputManager::bind_key(const std::string &keycombo, const std::string &cmd){ keymap_[keycombo]=cmd; }
-void InputManager::bind_button(const std::string &btncombo, const std::string &cmd){ btnmap_[btncombo]=cmd; }
-void InputManager::handle_key_event(xcb_key_press_event_t *ev) {
-    // TODO: translate ev to keycombo string then lookup in keymap_ and forward to ipc via a synthetic command
+void CommandScheduler::set_client_class(int client, CommandClass cls) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    classes_[client] = cls;
 }
-void InputManager::handle_button_event(xcb_button_press_event_t *ev) {
-    // TODO: translate button -> btncombo and handle
+
+CommandClass CommandScheduler::client_class(int client) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    auto it = classes_.find(client);
+    return it == classes_.end() ? CMD_IPC : it->second;
 }
 
-// ConfigLoader skeleton
-ConfigLoader::ConfigLoader(const std::string &path, IPCServer &ipc): path_(path), ipc_(ipc) {}
-ConfigLoader::~ConfigLoader() { stop(); }
-void ConfigLoader::run_once() {
-    // Execute the shell config script and pipe lines to the IPC socket (or directly call handler)
-    if (!fs::exists(path_)) return;
-    std::string cmd = "/bin/sh '" + path_ + "'";
-    // For simplicity we'll run the script and read its stdout which should contain "COMMAND lines"
-    FILE *p = popen(cmd.c_str(), "r");
-    if (!p) return;
-    char buf[512];
-    while (fgets(buf, sizeof(buf), p)) {
-        std::string line(buf);
-        while (!line.empty() && (line.back()=='\n' || line.back()=='\r')) line.pop_back();
-        if (!line.empty()) {
-            // naive: open a one-shot client to local socket and send the command
-            int sock = socket(AF_UNIX, SOCK_STREAM, 0);
-            if (sock>=0) {
-                sockaddr_un addr; memset(&addr,0,sizeof(addr)); addr.sun_family=AF_UNIX; strncpy(addr.sun_path, SOCK_PATH, sizeof(addr.sun_path)-1);
-                if (connect(sock, (sockaddr*)&addr, sizeof(addr))==0) {
-                    std::string out = line+"\n"; write(sock, out.c_str(), out.size()); close(sock);
-                } else close(sock);
-            }
-        }
-    }
-    pclose(p);
+void CommandScheduler::forget_client(int client) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    classes_.erase(client);
+    buckets_.erase(client);
 }
 
-void ConfigLoader::watch(std::function<void()> reload_callback) {
-    watching_ = true;
-    inotify_fd_ = inotify_init1(IN_NONBLOCK);
-    if (inotify_fd_ < 0) return;
-    int wd = inotify_add_watch(inotify_fd_, path_.c_str(), IN_MODIFY | IN_CLOSE_WRITE);
-    watch_thread_ = std::thread([this, reload_callback, wd]() {
-        constexpr size_t BUF=1024;
-        char buf[BUF];
-        while (watching_) {
-            ssize_t len = read(inotify_fd_, buf, BUF);
-            if (len>0) {
-                // naive: any event triggers reload
-                reload_callback();
-            }
-            std::this_thread::sleep_for(std::chrono::milliseconds(200));
-        }
-        if (wd>=0) inotify_rm_watch(inotify_fd_, wd);
-        close(inotify_fd_);
-    });
+json CommandScheduler::stats() const {
+    json j;
+    for (int c = 0; c < CMD_CLASSES; c++) j[CLASS_NAMES[c]] = {{"depth", depth((CommandClass)c)}, {"wait_us", wait_[c].summary()}};
+    std::lock_guard<std::mutex> lk(mtx_);
+    j["ipc"]["rejected"] = rejected_.get();
+    j["ipc"]["rate"] = rate_;
+    j["ipc"]["burst"] = burst_;
+    return j;
 }
 
-// BarPublisher skeleton
-BarPublisher::BarPublisher(IPCServer &ipc): ipc_(ipc) {}
-BarPublisher::~BarPublisher() {}
-void BarPublisher::publish_workspace(int current, const std::vector<int> &occupied) {
-    WmEvent e; e.type = "workspace"; e.payload["index"] = current; e.payload["occupied"] = occupied;
-    ipc_.emit_event(e);
+// Watchdog implementation
+Watchdog *Watchdog::instance_ = nullptr;
+
+uint64_t Watchdog::now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
 }
-void BarPublisher::publish_focus(WindowID id, const std::string &title) {
-    WmEvent e; e.type = "focus"; e.payload["win"] = id; e.payload["title"] = title;
-    ipc_.emit_event(e);
+bool Watchdog::start(FlightRecorder &flight, const XConnection &xc, const CommandScheduler &sched) {
+    if (thread_.joinable()) return true;
+    flight_ = &flight; xc_ = &xc; sched_ = &sched;
+    main_ = pthread_self();
+    void *warm[1];
+    backtrace(warm, 1); // loads libgcc now: the first call allocates, which a handler must not
+    instance_ = this;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = &Watchdog::on_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGNAL, &sa, nullptr) != 0) return false;
+    running_ = true;
+    thread_ = std::thread(&Watchdog::loop, this);
+    return true;
 }
-void BarPublisher::publish_bar_visible(bool visible) {
-    WmEvent e; e.type = "bar-toggle"; e.payload["visible"] = visible;
-    ipc_.emit_event(e);
+void Watchdog::stop() {
+    {
+        std::lock_guard<std::mutex> lk(mtx_);
+        running_ = false;
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) thread_.join();
+}
+void Watchdog::on_signal(int) {
+    // main thread, async-signal context: copy, no allocation, no locks
+    Watchdog *w = instance_;
+    if (!w) return;
+    int saved = errno;
+    w->nframes_ = backtrace(w->frames_, MAX_FRAMES);
+    w->cap_phase_ = w->phase.load(std::memory_order_relaxed);
+    w->cap_event_ = w->event.load(std::memory_order_relaxed);
+    const CommandScheduler::Job *job = w->sched_->running();
+    size_t n = job ? std::min(job->line.size(), sizeof(w->cap_command_) - 1) : 0;
+    if (n) memcpy(w->cap_command_, job->line.data(), n);
+    w->cap_command_[n] = 0;
+    w->cap_cmd_id_ = job ? job->req_id : 0;
+    w->captured_.store(true, std::memory_order_release);
+    errno = saved;
+}
+void Watchdog::loop() {
+    uint64_t reported = 0; // busy_since_ of the stall already reported
+    std::unique_lock<std::mutex> lk(mtx_);
+    while (running_) {
+        uint64_t threshold = threshold_ns_.load(std::memory_order_relaxed);
+        cv_.wait_for(lk, std::chrono::nanoseconds(std::max<uint64_t>(threshold / 4, 1000000)));
+        if (!running_) break;
+        uint64_t since = busy_since_.load(std::memory_order_relaxed);
+        if (!since || since == reported) continue;
+        uint64_t now = now_ns();
+        if (now - since < threshold) continue;
+        reported = since;
+        lk.unlock();
+        report(now - since);
+        lk.lock();
+    }
+}
+void Watchdog::report(uint64_t stalled_ns) {
+    stalls_.add();
+    captured_.store(false, std::memory_order_relaxed);
+    pthread_kill(main_, SIGNAL);
+    for (int i = 0; i < 100 && !captured_.load(std::memory_order_acquire); i++) usleep(1000);
+    uint64_t us = stalled_ns / 1000;
+    std::vector<std::string> lines; // record text; the first one says what was running
+    if (captured_.load(std::memory_order_acquire)) {
+        std::string what = std::string("phase=") + cap_phase_;
+        if (cap_event_ >= 0) {
+            const char *label = xcb_event_get_label(cap_event_);
+            what += " event=" + (label ? std::string(label) : std::to_string(cap_event_));
+        }
+        if (cap_command_[0]) what += " cmd" + (cap_cmd_id_ ? "#" + std::to_string(cap_cmd_id_) : std::string()) + "=" + cap_command_;
+        lines.push_back(what);
+        char **syms = backtrace_symbols(frames_, nframes_);
+        for (int i = 2; i < nframes_; i++) // skip on_signal and the signal trampoline
+            lines.push_back(syms ? syms[i] : "?");
+        free(syms);
+    } else {
+        lines.push_back("main thread did not answer the stack request");
+    }
+    std::cerr << "hibriwm: main loop stalled for " << us / 1000 << "ms (xseq " << xc_->last_sequence() << ")\n";
+    for (size_t i = 0; i < lines.size(); i++) {
+        std::cerr << "  " << lines[i] << "\n";
+        flight_->record(HWM_FL_STALL, us, i, lines[i]);
+    }
 }
 
 // WindowManager implementation skeleton
-WindowManager::WindowManager() : ipc_(SOCK_PATH) {
-    layout_ = std::make_unique<BSPLayout>();
+WindowManager::WindowManager() : ipc_(hwm_socket_path()) {
+    add_layout(std::make_unique<BSPLayout>());
+    auto cl = std::make_unique<ConstraintLayout>();
+    constraint_layout_ = cl.get();
+    add_layout(std::move(cl));
 }
 WindowManager::~WindowManager() { stop(); }
 
 bool WindowManager::init() {
     if (!xc_.connect()) return false;
+    {
+        // SubstructureRedirect makes this the window manager (MapRequest); SubstructureNotify
+        // brings UnmapNotify/DestroyNotify of top-level windows. Fails if another WM runs.
+        xcb_connection_t *c = xc_.conn();
+        uint32_t mask = XCB_EVENT_MASK_SUBSTRUCTURE_REDIRECT | XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY;
+        xc_.round_trip();
+        xcb_generic_error_t *err = xcb_request_check(c, xc_.sent(xcb_change_window_attributes_checked(c, xc_.root(), XCB_CW_EVENT_MASK, &mask)));
+        if (err) { free(err); std::cerr << "hibriwm: another window manager is running\n"; return false; }
+    }
+#ifdef HIBRIWM_TRACE
+    Tracer::get().set_connection(&xc_);
+#endif
+    const char *rundir = getenv("XDG_RUNTIME_DIR");
+    flight_.set_connection(&xc_);
+    if (flight_.open(std::string(rundir && *rundir ? rundir : "/tmp") + "/hibriwm.flight")) {
+        flight_.record(HWM_FL_START, getpid(), 0, "hibriwm");
+        sched_.set_flight_recorder(&flight_);
+    }
+    if (!watchdog_.start(flight_, xc_, sched_)) std::cerr << "hibriwm: watchdog not started\n";
+    signal(SIGCHLD, SIG_IGN); // spawned clients are never waited for
+    // one Monitor per RandR output, the primary is monitor 0; no RandR: the whole screen
+    std::vector<Geometry> outs = xc_.outputs();
+    xcb_screen_t *scr = xc_.screen();
+    if (outs.empty()) outs.push_back(Geometry{0, 0, scr->width_in_pixels, scr->height_in_pixels});
+    for (size_t i = 0; i < outs.size(); i++) {
+        const Geometry &g = outs[i];
+        monitors_[(int)i] = Monitor{g.x, g.y, g.w, g.h, (int)i, {}, g};
+        show_on_monitor((int)i + 1, (int)i); // workspace 1 on the primary, 2 on the next...
+    }
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (state_page_.create()) ipc_.set_state_fd(state_page_.reader_fd());
+    ipc_.set_snapshot_provider([this]() { return state_snapshot(); });
+    ipc_.set_query_handler([this](const std::string &q) { return query(q); });
+    ipc_.set_tree_writer([this](int fd, const std::string &prefix) { write_tree(fd, prefix); });
+    bar_ = new BarPublisher(ipc_); // before the IPC server: handlers publish through it
+
     // start IPC server and hand it a handler that parses commands -> methods
-    ipc_.start([this](const std::string &cmdline){
-        // VERY simple parsing: split by spaces; production should use quoted parsing
-        std::istringstream iss(cmdline);
-        std::string cmd; iss >> cmd;
-        if (cmd=="spawn") { std::string rest; getline(iss, rest); cmd_spawn(rest); }
-        else if (cmd=="view") { int ws; iss >> ws; cmd_view_ws(ws); }
-        else if (cmd=="togglebar") cmd_toggle_bar();
-        else if (cmd=="set-border") { std::string which; int w; iss>>which>>w; cmd_set_border(which=="inner"?INNER_BORDER:OUTER_BORDER,w); }
-        else if (cmd=="set-color") { std::string which, col; iss>>which>>col; cmd_set_color(which=="inner"?INNER_BORDER:OUTER_BORDER,col); }
-        else if (cmd=="reload-config") cmd_reload_config();
-        else if (cmd=="quit") cmd_quit();
-        // TODO: many more commands
+    // (parsed on the IPC thread, executed by the main loop through the scheduler)
+    ipc_.start([this](const std::string &cmdline, int client, uint64_t id) {
+        std::promise<std::string> done;
+        std::future<std::string> reply = done.get_future();
+        if (cmdline.compare(0, 13, "client-class ")==0) { // the config loader marks its connection
+            sched_.set_client_class(client, cmdline.substr(13)=="config" ? CMD_CONFIG : CMD_IPC);
+            done.set_value("OK");
+            return reply;
+        }
+        auto cmd = compile_command(cmdline);
+        if (!cmd) { done.set_value("ERR unknown command"); return reply; }
+        CommandScheduler::Job job{std::move(*cmd), std::move(done), CommandScheduler::Clock::now(), id, cmdline};
+        if (sched_.push(sched_.client_class(client), client, std::move(job))) wake();
+        return reply;
     });
+    ipc_.set_disconnect_handler([this](int fd) { sched_.forget_client(fd); });
 
     input_ = new InputManager(xc_, ipc_);
+    input_->set_dispatch([this](const std::string &cmdline) { submit(CMD_INPUT, cmdline); });
     input_->register_default_bindings();
 
     cfg_ = new ConfigLoader(CONFIG_PATH, ipc_);
-    cfg_->run_once();
-    cfg_->watch([this](){ this->cmd_reload_config(); });
-
-    bar_ = new BarPublisher(ipc_);
+    cmd_reload_config(); // runs alongside the main loop, which executes what it sends
+    cfg_->watch([cfg = cfg_]() { cfg->reload(); }); // the watcher never outlives its loader
 
     running_ = true;
     return true;
 }
 
 void WindowManager::run() {
-    // Main event loop
+    // Main event loop: one iteration = wait, drain every queued X event, then end_iteration()
     xcb_connection_t *c = xc_.conn();
     xcb_generic_event_t *ev;
+    pollfd fds[2] = {{xcb_get_file_descriptor(c), POLLIN, 0}, {wake_fd_, POLLIN, 0}};
+    TRACE_THREAD("main");
     while (running_) {
-        ev = xcb_wait_for_event(c);
-        if (!ev) break;
-        uint8_t type = ev->response_type & ~0x80;
-        switch (type) {
-            case XCB_MAP_REQUEST: handle_map_request((xcb_map_request_event_t*)ev); break;
-            case XCB_UNMAP_NOTIFY: handle_unmap_notify((xcb_unmap_notify_event_t*)ev); break;
-            case XCB_CONFIGURE_REQUEST: handle_configure_request((xcb_configure_request_event_t*)ev); break;
-            case XCB_KEY_PRESS: handle_key_press((xcb_key_press_event_t*)ev); break;
-            case XCB_BUTTON_PRESS: handle_button_press((xcb_button_press_event_t*)ev); break;
-            default: break;
+        int timeout = -1;
+        if (next_flush_) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(*next_flush_ - std::chrono::steady_clock::now()).count();
+            timeout = (int)std::max<long long>(0, left + 1);
+        }
+        if (ipc_.has_pending()) timeout = timeout < 0 ? IPC_RETRY_MS : std::min(timeout, IPC_RETRY_MS); // a slow subscriber catching up
+        if (poll(fds, 2, timeout) < 0 && errno != EINTR) break;
+        auto woke = std::chrono::steady_clock::now();
+        watchdog_.busy();
+        TRACE_SPAN("iteration");
+        if (fds[1].revents & POLLIN) { uint64_t n; read(wake_fd_, &n, sizeof(n)); }
+        watchdog_.phase = "x events";
+        while ((ev = xcb_poll_for_event(c))) { handle_event(ev); free(ev); }
+        watchdog_.event = -1;
+        if (xcb_connection_has_error(c)) break;
+        watchdog_.phase = "commands";
+        // queued commands, input bindings (queued by the events above) first; whatever the
+        // budget leaves over runs next iteration, after any newly arrived X events
+        bool more = sched_.run(cmd_budget_);
+        watchdog_.phase = "end_iteration";
+        end_iteration();
+        loop_us_.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - woke).count());
+        watchdog_.idle();
+        if (more) wake();
+    }
+}
+
+void WindowManager::handle_event(xcb_generic_event_t *ev) {
+    uint8_t type = ev->response_type & ~0x80;
+    Metrics::Counter *&seen = event_count_[type];
+    if (!seen) {
+        const char *label = xcb_event_get_label(type);
+        seen = &metrics().counter("hibriwm_x_events_total", "X events handled",
+                                  "type=\"" + (label ? std::string(label) : std::to_string(type)) + "\"");
+    }
+    seen->add();
+    uint64_t arg = 0; // recorded before dispatch: a crash in the handler still shows the event
+    switch (type) {
+        case XCB_MAP_REQUEST: arg = ((xcb_map_request_event_t*)ev)->window; break;
+        case XCB_UNMAP_NOTIFY: arg = ((xcb_unmap_notify_event_t*)ev)->window; break;
+        case XCB_DESTROY_NOTIFY: arg = ((xcb_destroy_notify_event_t*)ev)->window; break;
+        case XCB_CONFIGURE_REQUEST: arg = ((xcb_configure_request_event_t*)ev)->window; break;
+        case XCB_KEY_PRESS: arg = ((xcb_key_press_event_t*)ev)->detail | ((xcb_key_press_event_t*)ev)->state << 8; break;
+        case XCB_BUTTON_PRESS: arg = ((xcb_button_press_event_t*)ev)->detail | ((xcb_button_press_event_t*)ev)->state << 8; break;
+        default: break;
+    }
+    flight_.record(HWM_FL_EVENT, type, arg);
+    watchdog_.event = type;
+    TRACE_SPAN_D("event", xcb_event_get_label(type) ? xcb_event_get_label(type) : std::to_string(type));
+    switch (type) {
+        case XCB_MAP_REQUEST: { XConnection::Op op(xc_, "map-request"); handle_map_request((xcb_map_request_event_t*)ev); break; }
+        case XCB_UNMAP_NOTIFY: { XConnection::Op op(xc_, "unmap-notify"); handle_unmap_notify((xcb_unmap_notify_event_t*)ev); break; }
+        case XCB_DESTROY_NOTIFY: { XConnection::Op op(xc_, "destroy-notify"); handle_destroy_notify((xcb_destroy_notify_event_t*)ev); break; }
+        case XCB_CONFIGURE_REQUEST: handle_configure_request((xcb_configure_request_event_t*)ev); break;
+        case XCB_KEY_PRESS: { XConnection::Op op(xc_, "key-press", XConnection::Op::HOT); handle_key_press((xcb_key_press_event_t*)ev); break; }
+        case XCB_BUTTON_PRESS: handle_button_press((xcb_button_press_event_t*)ev); break;
+        case XCB_MAPPING_NOTIFY:
+            if (((xcb_mapping_notify_event_t*)ev)->request != XCB_MAPPING_POINTER) input_->refresh_keymap();
+            break;
+        case XCB_EXPOSE: {
+            XConnection::Op op(xc_, "bar");
+            auto *e = (xcb_expose_event_t*)ev;
+            if (e->count) break;
+            if (native_bar_) native_bar_->expose(e->window);
+            for (auto &p : windows_) // tab strips
+                if (p.second.frame && p.second.frame->frame_win() == e->window) { p.second.frame->draw(); xcb_flush(xc_.conn()); }
+            break;
+        }
+        default: break;
+    }
+}
+
+void WindowManager::end_iteration() {
+    if (hooks_pending_) run_hooks();
+    publish_snapshot();
+    hwm_state_t st;
+    memset(&st, 0, sizeof(st)); // padding too: publish() compares bytes
+    {
+        std::shared_lock<std::shared_mutex> lk(state_mtx_);
+        fill_state(st);
+    }
+    state_page_.publish(st);
+    sched_.answer(); // after both publishes: replies never run ahead of what readers see
+    {
+        XConnection::Op op(xc_, "bar");
+        next_flush_ = bar_->flush(std::chrono::steady_clock::now());
+    }
+    ipc_.notify_ring();
+    ipc_.flush_pending();
+}
+
+void WindowManager::fire_hooks(const std::string &event, const WmWindow *w, const Workspace *ws) {
+    bool woke = false;
+    for (const Hook &h : hooks_) {
+        if (h.event != event || !h.match.matches(w, ws)) continue;
+        HookFiring f{h.steps, {"HWM_EVENT=" + event}};
+        if (w) {
+            f.env.push_back("HWM_WIN=" + std::to_string(w->id));
+            f.env.push_back("HWM_CLASS=" + w->cls);
+            f.env.push_back("HWM_TITLE=" + w->title);
+        }
+        if (ws) f.env.push_back("HWM_WS=" + std::to_string(ws->index));
+        pending_hooks_.push_back(std::move(f));
+        woke = true;
+    }
+    if (woke) { hooks_pending_ = true; wake(); } // fired off the main loop: run_hooks needs a turn
+}
+
+void WindowManager::run_hooks() {
+    auto lk = lock_state();
+    std::vector<HookFiring> firing;
+    firing.swap(pending_hooks_); // events raised by these steps run next iteration
+    hooks_pending_ = false;
+    for (HookFiring &f : firing) {
+        spawn_env_ = std::move(f.env);
+        run_steps(*f.steps);
+    }
+    spawn_env_.clear();
+}
+
+void WindowManager::submit(CommandClass cls, const std::string &cmdline) {
+    auto cmd = compile_command(cmdline);
+    if (!cmd) return;
+    if (cls == CMD_INPUT) // the rest of a key press: as hot as its dispatch (waits are whitelisted with Op::WAITS)
+        cmd = [this, run = std::move(*cmd)]() { XConnection::Op op(xc_, "key-binding", XConnection::Op::HOT); run(); };
+    sched_.push(cls, 0, {std::move(*cmd), std::promise<std::string>(), CommandScheduler::Clock::now(), 0, cmdline});
+    wake();
+}
+
+void WindowManager::wake() {
+    uint64_t one = 1;
+    if (wake_fd_ >= 0) write(wake_fd_, &one, sizeof(one));
+}
+
+json WindowManager::state_snapshot() {
+    std::shared_ptr<const StateSnapshot> st = current_snapshot();
+    json snap;
+    std::vector<int> occ;
+    for (auto &p : st->workspaces) if (!p.second->tiled.empty() || !p.second->floating.empty()) occ.push_back(p.first);
+    snap["workspace"] = {{"index", st->current_ws}, {"occupied", occ}};
+    auto fit = st->windows.find(st->focused);
+    snap["focus"] = {{"win", fit != st->windows.end() ? fit->first : 0}, {"title", fit != st->windows.end() ? fit->second->title : ""}};
+    snap["bar-toggle"] = {{"visible", st->bar_visible}};
+    return snap;
+}
+
+void WindowManager::publish_snapshot() {
+    std::shared_ptr<const StateSnapshot> prev = current_snapshot();
+    std::shared_lock<std::shared_mutex> lk(state_mtx_);
+    uint64_t gen = state_gen_;
+    if (gen == prev->gen) return; // nothing was written since the last publish
+    auto snap = std::make_shared<StateSnapshot>();
+    snap->gen = gen;
+    snap->current_ws = current_ws_;
+    snap->focused = focused_window();
+    snap->bar_visible = bar_visible_;
+    for (auto &p : monitors_) snap->monitors.push_back(p.second);
+    for (auto &p : workspaces_) {
+        const Workspace &ws = p.second;
+        auto lit = layouts_.find(ws.layout);
+        LayoutTree tree = lit != layouts_.end() ? lit->second->snapshot(ws) : nullptr;
+        auto old = prev->workspaces.find(p.first);
+        if (old != prev->workspaces.end()) {
+            const StateSnapshot::Ws &o = *old->second;
+            if (o.monitor_id == ws.monitor_id && o.layout == ws.layout && o.visible == ws.visible && o.focused == ws.focused
+                && o.tree == tree && o.tiled == ws.tiled && o.floating == ws.floating && o.groups == ws.groups) {
+                snap->workspaces.emplace_hint(snap->workspaces.end(), p.first, old->second);
+                continue;
+            }
+        }
+        snap->workspaces.emplace_hint(snap->workspaces.end(), p.first, std::make_shared<const StateSnapshot::Ws>(StateSnapshot::Ws{
+            ws.index, ws.monitor_id, ws.layout, ws.visible, ws.focused, tree, ws.tiled, ws.floating, ws.groups}));
+    }
+    for (auto &p : windows_) {
+        const WmWindow &w = p.second;
+        const Geometry &g = w.floating ? w.geom_floating : w.geom_tiled;
+        auto old = prev->windows.find(p.first);
+        if (old != prev->windows.end()) {
+            const StateSnapshot::Window &o = *old->second;
+            if (o.cls == w.cls && o.title == w.title && o.geom.x == g.x && o.geom.y == g.y && o.geom.w == g.w && o.geom.h == g.h
+                && o.floating == w.floating && o.fullscreen == w.fullscreen && o.scratch == w.scratch && o.pid == w.pid
+                && o.workspace == w.workspace && o.group == w.group) {
+                snap->windows.emplace_hint(snap->windows.end(), p.first, old->second);
+                continue;
+            }
+        }
+        snap->windows.emplace_hint(snap->windows.end(), p.first, std::make_shared<const StateSnapshot::Window>(StateSnapshot::Window{
+            w.id, w.cls, w.title, g, w.floating, w.fullscreen, w.scratch, w.pid, w.workspace, w.group}));
+    }
+    snap->index = index_.view(); // shares every field map and bucket: O(1)
+    lk.unlock();
+    std::atomic_store(&snapshot_, std::shared_ptr<const StateSnapshot>(std::move(snap)));
+}
+
+std::string WindowManager::query(const std::string &q) {
+    // windows [where <term> [and <term>]...] [fields=<f>,...] [limit=<n>]
+    // terms as in Matcher; fields: id class title workspace monitor pid floating fullscreen geom group
+    using Win = StateSnapshot::Window;
+    using Ws = StateSnapshot::Ws;
+    using Project = std::function<void(json&, const Win&, const Ws*)>;
+    static const std::map<std::string, Project> projections = {
+        {"id", [](json &j, const Win &w, const Ws*) { j["id"] = w.id; }},
+        {"class", [](json &j, const Win &w, const Ws*) { j["class"] = w.cls; }},
+        {"title", [](json &j, const Win &w, const Ws*) { j["title"] = w.title; }},
+        {"workspace", [](json &j, const Win &w, const Ws*) { j["workspace"] = w.workspace; }},
+        {"monitor", [](json &j, const Win&, const Ws *ws) { j["monitor"] = ws ? ws->monitor_id : -1; }},
+        {"pid", [](json &j, const Win &w, const Ws*) { j["pid"] = w.pid; }},
+        {"floating", [](json &j, const Win &w, const Ws*) { j["floating"] = w.floating; }},
+        {"fullscreen", [](json &j, const Win &w, const Ws*) { j["fullscreen"] = w.fullscreen; }},
+        {"geom", [](json &j, const Win &w, const Ws*) {
+            j["geom"] = {w.geom.x, w.geom.y, w.geom.w, w.geom.h}; }},
+        {"group", [](json &j, const Win &w, const Ws*) { j["group"] = w.group; }},
+    };
+    std::istringstream iss(q);
+    std::string what; iss >> what;
+    if (what=="sched") return sched_.stats().dump();
+    if (what=="metrics") { // [format=json|prometheus]
+        std::string fmt; iss >> fmt;
+        if (fmt=="format=prometheus") return metrics().to_prometheus();
+        return fmt.empty() || fmt=="format=json" ? metrics().to_json().dump() : "ERR unknown format";
+    }
+    if (what!="windows") return "ERR unknown query";
+    Matcher match;
+    std::vector<std::pair<std::string, std::string>> equalities; // candidates for an index lookup
+    std::vector<const Project*> fields;
+    size_t limit = SIZE_MAX;
+    for (std::string t; iss>>t;) {
+        if (t=="where" || t=="and") continue;
+        if (t.compare(0, 7, "fields=")==0) {
+            std::istringstream fs(t.substr(7));
+            for (std::string f; getline(fs, f, ',');) {
+                auto it = projections.find(f);
+                if (it == projections.end()) return "ERR unknown field " + f;
+                fields.push_back(&it->second);
+            }
+            continue;
         }
-        free(ev);
+        if (t.compare(0, 6, "limit=")==0) { limit = strtoull(t.c_str() + 6, nullptr, 10); continue; }
+        if (!match.add_term(t)) return "ERR bad term " + t;
+        size_t eq = t.find('=');
+        if (eq != std::string::npos && t[eq-1] != '!') equalities.emplace_back(t.substr(0, eq), t.substr(eq+1));
+    }
+    if (fields.empty()) fields.push_back(&projections.at("id"));
+
+    // lock-free: everything below reads one immutable snapshot
+    std::shared_ptr<const StateSnapshot> snap = current_snapshot();
+    const WindowIndex::View &index = snap->index;
+    // plan: walk the smallest candidate set any equality term yields, else every window
+    std::deque<std::set<WindowID>> derived; // candidate sets not stored in the index
+    const std::set<WindowID> *best = nullptr;
+    for (auto &e : equalities) {
+        const std::set<WindowID> *c = index.lookup(e.first, e.second);
+        if (e.first=="id") {
+            WindowID id = strtoul(e.second.c_str(), nullptr, 0);
+            derived.emplace_back();
+            if (snap->windows.count(id)) derived.back().insert(id);
+            c = &derived.back();
+        } else if (e.first=="monitor") { // workspaces of the monitor, via the workspace index
+            int mon = atoi(e.second.c_str());
+            derived.emplace_back();
+            for (auto &p : snap->workspaces)
+                if (p.second->monitor_id == mon)
+                    if (auto ws = index.lookup("workspace", std::to_string(p.first))) derived.back().insert(ws->begin(), ws->end());
+            c = &derived.back();
+        }
+        if (c && (!best || c->size() < best->size())) best = c;
+    }
+    json out = json::array();
+    auto visit = [&](const Win &w) {
+        if (out.size() >= limit) return false;
+        auto wsit = snap->workspaces.find(w.workspace);
+        const Ws *ws = wsit != snap->workspaces.end() ? wsit->second.get() : nullptr;
+        if (!match.matches(&w, ws)) return true;
+        json j = json::object();
+        for (const Project *p : fields) (*p)(j, w, ws);
+        out.push_back(std::move(j));
+        return true;
+    };
+    if (best) {
+        for (WindowID id : *best) {
+            auto it = snap->windows.find(id);
+            if (it != snap->windows.end() && !visit(*it->second)) break;
+        }
+    } else {
+        for (auto &p : snap->windows) if (!visit(*p.second)) break;
+    }
+    return out.dump();
+}
+
+void WindowManager::write_tree(int fd, const std::string &prefix) {
+    // monitors -> workspaces -> layout tree -> windows, one JSON line produced piecewise from
+    // a snapshot: no lock is held while writing and the document never exists as a whole
+    std::shared_ptr<const StateSnapshot> snap = current_snapshot();
+    ChunkWriter out(fd);
+    auto win = [&](WindowID id) {
+        auto it = snap->windows.find(id);
+        if (it == snap->windows.end()) { out << json{{"id", id}}.dump(); return; }
+        const StateSnapshot::Window &w = *it->second;
+        json j = {{"id", w.id}, {"class", w.cls}, {"title", w.title}, {"geom", {w.geom.x, w.geom.y, w.geom.w, w.geom.h}},
+                  {"floating", w.floating}, {"fullscreen", w.fullscreen}, {"pid", w.pid}};
+        out << j.dump();
+    };
+    auto list = [&](const std::vector<WindowID> &ids) {
+        out << "[";
+        for (size_t i = 0; i < ids.size() && out.ok(); i++) { if (i) out << ","; win(ids[i]); }
+        out << "]";
+    };
+    std::function<void(const LayoutTree&)> node = [&](const LayoutTree &t) {
+        if (!t) { out << "null"; return; }
+        if (t->kind == LayoutNode::LEAF) { win(t->win); return; }
+        out << "{\"split\":\"" << (t->kind == LayoutNode::SPLIT_H ? "h" : "v") << "\",\"ratio\":" << json(t->ratio).dump() << ",\"children\":[";
+        node(t->first); out << ","; node(t->second);
+        out << "]}";
+    };
+    out << prefix << "{\"current_ws\":" << std::to_string(snap->current_ws) << ",\"focused\":" << std::to_string(snap->focused) << ",\"monitors\":[";
+    for (size_t mi = 0; mi < snap->monitors.size() && out.ok(); mi++) {
+        const Monitor &m = snap->monitors[mi];
+        if (mi) out << ",";
+        out << "{\"id\":" << std::to_string(m.id)
+            << ",\"screen\":" << json{m.screen.x, m.screen.y, m.screen.w, m.screen.h}.dump()
+            << ",\"area\":" << json{m.x, m.y, m.w, m.h}.dump() << ",\"workspaces\":[";
+        bool first = true;
+        for (auto &wp : snap->workspaces) {
+            const StateSnapshot::Ws &ws = *wp.second;
+            // workspaces on a monitor that is gone are listed under the first one
+            bool here = ws.monitor_id == m.id || (mi == 0 && std::none_of(snap->monitors.begin(), snap->monitors.end(),
+                                                                           [&](const Monitor &o) { return o.id == ws.monitor_id; }));
+            if (!here || !out.ok()) continue;
+            if (!first) out << ",";
+            first = false;
+            out << "{\"index\":" << std::to_string(ws.index) << ",\"layout\":" << json(ws.layout).dump()
+                << ",\"visible\":" << (ws.visible ? "true" : "false") << ",\"focused\":" << std::to_string(ws.focused) << ",\"tree\":";
+            if (ws.tree) node(ws.tree); else list(ws.tiled);
+            out << ",\"floating\":"; list(ws.floating);
+            out << ",\"containers\":[";
+            bool gfirst = true;
+            for (auto &g : ws.groups) {
+                if (!gfirst) out << ",";
+                gfirst = false;
+                out << "{\"id\":" << std::to_string(g.first) << ",\"stacked\":" << (g.second.stacked ? "true" : "false")
+                    << ",\"active\":" << std::to_string(g.second.active) << ",\"children\":";
+                list(g.second.children);
+                out << "}";
+            }
+            out << "]}";
+        }
+        out << "]}";
+    }
+    out << "],\"scratch\":[";
+    bool first = true;
+    for (auto &p : snap->windows) {
+        if (!p.second->scratch || !out.ok()) continue;
+        if (!first) out << ",";
+        first = false;
+        win(p.first);
+    }
+    out << "]}\n";
+    out.flush();
+}
+
+void WindowManager::fill_state(hwm_state_t &st) {
+    st.focused_ws = current_ws_;
+    st.bar_visible = bar_visible_;
+    for (auto &p : workspaces_) {
+        const Workspace &ws = p.second;
+        if (p.first >= 0 && p.first < 64 && (!ws.tiled.empty() || !ws.floating.empty()))
+            st.occupied |= uint64_t(1) << p.first;
+    }
+    auto fit = windows_.find(focused_window());
+    if (fit != windows_.end()) {
+        st.focused_win = fit->first;
+        strncpy(st.title, fit->second.title.c_str(), HWM_TITLE_MAX-1);
+    }
+    auto cw = workspaces_.find(current_ws_); // read-only: callers hold state_mtx_ shared
+    int cur_mon = cw != workspaces_.end() ? cw->second.monitor_id : 0;
+    for (auto &p : monitors_) {
+        if (st.nmonitors == HWM_MAX_MONITORS) break;
+        const Monitor &m = p.second;
+        hwm_monitor_state_t &ms = st.monitors[st.nmonitors++];
+        ms.x = m.x; ms.y = m.y; ms.w = m.w; ms.h = m.h;
+        if (m.id == cur_mon) ms.current_ws = current_ws_;
+        else for (auto &w : workspaces_) if (w.second.visible && w.second.monitor_id == m.id) { ms.current_ws = w.first; break; }
+        auto wit = workspaces_.find(ms.current_ws);
+        if (wit != workspaces_.end()) strncpy(ms.layout, wit->second.layout.c_str(), HWM_LAYOUT_NAME_MAX-1);
     }
 }
 
 void WindowManager::stop() {
     running_ = false;
+    sched_.close("ERR shutting down"); // clients waiting on queued commands get an answer
+    watchdog_.stop();
     ipc_.stop();
     if (cfg_) { delete cfg_; cfg_ = nullptr; }
     if (input_) { delete input_; input_ = nullptr; }
 }
 
+std::optional<CompiledCommand> WindowManager::compile_command(const std::string &cmdline) {
+    // VERY simple parsing: split by spaces; production should use quoted parsing
+    std::istringstream iss(cmdline);
+    std::string cmd; iss >> cmd;
+    if (cmd=="spawn") { std::string rest; getline(iss, rest); return [this, rest]{ cmd_spawn(rest); }; }
+    if (cmd=="scratch") { std::string a, b; iss>>a>>b; return [this, a, b]{ if (a=="toggle") cmd_scratch_toggle(b); else cmd_scratch_define(a); }; }
+    if (cmd=="view") { int ws=0; iss >> ws; return [this, ws]{ cmd_view_ws(ws); }; }
+    if (cmd=="move-ws") {
+        int ws = 0, mon = -1; std::string kw; iss>>ws>>kw>>mon;
+        if (kw!="monitor" || mon < 0) return std::nullopt;
+        return [this, ws, mon]{ cmd_move_ws(ws, mon); };
+    }
+    if (cmd=="togglebar") return [this]{ cmd_toggle_bar(); };
+    if (cmd=="bar") { std::string key, val; iss>>key>>std::ws; getline(iss, val); return [this, key, val]{ cmd_bar_option(key, val); }; }
+    if (cmd=="set-workspaces") { std::vector<std::string> defs; std::string d; while (iss>>d) defs.push_back(d); return [this, defs]{ cmd_set_workspaces(defs); }; }
+    if (cmd=="bind") { // bind <combo> <command>, e.g. bind Mod4-Shift-Return spawn st
+        std::string combo, rest; iss>>combo>>std::ws; getline(iss, rest);
+        if (!InputManager::valid_combo(combo) || rest.empty()) return std::nullopt;
+        return [this, combo, rest]{ input_->bind_key(combo, rest); };
+    }
+    if (cmd=="focus") { std::string dir; iss>>dir; return [this, dir]{ cmd_focus_direction(dir); }; }
+    if (cmd=="move") { std::string dir; iss>>dir; return [this, dir]{ cmd_move_direction(dir); }; }
+    if (cmd=="swap") { WindowID a=0, b=0; iss>>a>>b; return [this, a, b]{ cmd_swap(a,b); }; }
+    if (cmd=="promote") { WindowID id=0; iss>>id; return [this, id]{ cmd_promote(id); }; }
+    if (cmd=="resize") { std::string sx, sy; iss>>sx>>sy; int dx = atoi(sx.c_str()), dy = atoi(sy.c_str()); return [this, dx, dy]{ cmd_resize_rel(dx, dy); }; }
+    if (cmd=="layout") { std::string op, name; iss>>op>>name; return [this, op, name]{ cmd_layout_history(op, name); }; }
+    if (cmd=="set-layout") { std::string name; int ws=0; iss>>name>>ws; return [this, name, ws]{ cmd_set_layout(name, ws); }; }
+    if (cmd=="layout-generator") { std::string name, sock; int ms=20; iss>>name>>sock>>ms; return [this, name, sock, ms]{ cmd_layout_generator(name, sock, ms); }; }
+    if (cmd=="layout-plugin") { std::string path; iss>>path; return [this, path]{ cmd_layout_plugin(path); }; }
+    if (cmd=="container") { std::string mode; iss>>mode; return [this, mode]{ cmd_container(mode); }; }
+    if (cmd=="tab") { std::string dir; iss>>dir; int d = dir=="prev" ? -1 : 1; return [this, d]{ cmd_tab_cycle(d); }; }
+    if (cmd=="constraint") { int ws=0; std::string op, a, b; iss>>ws>>op>>a>>b; return [this, ws, op, a, b]{ cmd_constraint(ws, op, a, b); }; }
+    if (cmd=="set-border") { std::string which; int w=0; iss>>which>>w; BorderType t = which=="inner"?INNER_BORDER:OUTER_BORDER; return [this, t, w]{ cmd_set_border(t, w); }; }
+    if (cmd=="set-color") { std::string which, col; iss>>which>>col; BorderType t = which=="inner"?INNER_BORDER:OUTER_BORDER; return [this, t, col]{ cmd_set_color(t, col); }; }
+    if (cmd=="macro") {
+        // compiled here, so a bad step is reported when the macro is defined, not when run
+        std::string name, body; iss>>name>>std::ws; getline(iss, body);
+        auto m = compile_steps(body);
+        if (name.empty() || !m) return std::nullopt;
+        return [this, name, m]{ std::lock_guard<std::mutex> lk(macros_mtx_); macros_[name] = m; };
+    }
+    if (cmd=="hook") {
+        // hook <map|unmap|focus|workspace> [predicate]... do <cmd>; <cmd>; ...
+        // hook clear
+        Hook h;
+        iss>>h.event;
+        if (h.event=="clear") return [this]{ auto lk = lock_state(); hooks_.clear(); };
+        if (h.event!="map" && h.event!="unmap" && h.event!="focus" && h.event!="workspace") return std::nullopt;
+        std::string term;
+        while (iss>>term && term!="do")
+            if (!h.match.add_term(term)) return std::nullopt;
+        std::string body; getline(iss, body);
+        if (term!="do" || !(h.steps = compile_steps(body))) return std::nullopt;
+        return [this, h]{ auto lk = lock_state(); hooks_.push_back(h); };
+    }
+    if (cmd=="run") { std::string name; iss>>name; return [this, name]{ cmd_run_macro(name); }; }
+    if (cmd=="watchdog") { // watchdog <ms>: report iterations busy for longer than that
+        long ms = 0; iss>>ms;
+        if (ms <= 0) return std::nullopt;
+        return [this, ms]{ watchdog_.set_threshold(std::chrono::milliseconds(ms)); };
+    }
+#ifdef HIBRIWM_TRACE
+    if (cmd=="trace") { // trace start [file] | trace stop [file]
+        std::string op, file; iss>>op>>file;
+        if (op=="start") return [file]{ Tracer::get().start(file); };
+        if (op=="stop") return [file]{ Tracer::get().stop(file); };
+        return std::nullopt;
+    }
+#endif
+    if (cmd=="sched") {
+        // sched rate <commands/s> [burst] | sched budget-us <us>
+        std::string key; double a = 0, b = 0; iss>>key>>a;
+        if (key=="rate") { if (!(iss>>b)) b = a / 4; return [this, a, b]{ sched_.set_rate(a, b); }; }
+        if (key=="budget-us") return [this, a]{ cmd_budget_ = std::chrono::microseconds(std::max<long>(100, (long)a)); };
+        return std::nullopt;
+    }
+    if (cmd=="rule") {
+        // rule <predicate>... [workspace=N] [monitor=N] [float=true|false] [area=x,y,w,h] [macro=<name>]
+        // (area: where a floating window goes, in percent of its monitor)
+        // (workspace/monitor are actions here: a rule runs before the window has a workspace)
+        Rule r;
+        for (std::string kv; iss>>kv;) {
+            size_t eq = kv.find('=');
+            std::string k = kv.substr(0, eq), v = eq == std::string::npos ? "" : kv.substr(eq+1);
+            if (k=="workspace") r.workspace = atoi(v.c_str());
+            else if (k=="monitor") r.monitor_id = atoi(v.c_str());
+            else if (k=="float") r.floating = v=="true" || v=="1";
+            else if (k=="area") r.area = v;
+            else if (k=="macro") r.macro = v;
+            else if (!r.match.add_term(kv)) return std::nullopt;
+        }
+        return [this, r]{ auto lk = lock_state(); rules_.add_rule(r); };
+    }
+    if (cmd=="reload-config") return [this]{ cmd_reload_config(); };
+    if (cmd=="quit") return [this]{ cmd_quit(); };
+    // TODO: many more commands
+    return std::nullopt;
+}
+
+std::unique_lock<std::shared_mutex> WindowManager::lock_state() {
+    // inside a macro the batch already holds the lock
+    if (batch_owner_.load() == std::this_thread::get_id()) return std::unique_lock<std::shared_mutex>(state_mtx_, std::defer_lock);
+    std::unique_lock<std::shared_mutex> lk(state_mtx_);
+    state_gen_++; // taken to write: the next publish_snapshot() rebuilds
+    return lk;
+}
+
+void WindowManager::cmd_run_macro(const std::string &name) {
+    auto lk = lock_state();
+    run_macro(name);
+}
+
+std::shared_ptr<const Macro> WindowManager::compile_steps(const std::string &body) {
+    // compiled here, so a bad step is reported when the list is defined, not when run
+    auto m = std::make_shared<Macro>();
+    std::istringstream steps(body);
+    for (std::string step; getline(steps, step, ';');) {
+        step.erase(0, step.find_first_not_of(' '));
+        if (step.empty()) continue;
+        std::string verb = step.substr(0, step.find(' '));
+        if (verb=="macro" || verb=="hook" || verb=="reload-config" || verb=="quit") return nullptr; // not batchable
+        auto c = compile_command(step);
+        if (!c) return nullptr;
+        m->push_back(std::move(*c));
+    }
+    return m;
+}
+
+void WindowManager::run_macro(const std::string &name) {
+    std::shared_ptr<const Macro> m;
+    {
+        std::lock_guard<std::mutex> lk(macros_mtx_);
+        auto it = macros_.find(name);
+        if (it != macros_.end()) m = it->second;
+    }
+    if (m) run_steps(*m);
+}
+
+void WindowManager::run_steps(const Macro &m) {
+    if (macro_depth_ >= MACRO_DEPTH_MAX) return;
+    bool outer = batch_owner_.load() != std::this_thread::get_id();
+    if (outer) batch_owner_ = std::this_thread::get_id();
+    macro_depth_++;
+    for (const CompiledCommand &step : m) step();
+    macro_depth_--;
+    if (!outer) return;
+    // one relayout per touched workspace, however many steps touched it
+    batch_owner_ = std::thread::id();
+    std::set<int> dirty;
+    dirty.swap(deferred_relayout_);
+    for (int ws : dirty) relayout(ws);
+    xcb_flush(xc_.conn());
+}
+
 // Command stubs
 void WindowManager::cmd_spawn(const std::string &cmdline, std::optional<int> workspace_area) { 
-    // TODO: fork/exec; use rules to place on workspace/area
+    spawn_process(cmdline);
+    // TODO: use rules to place on workspace/area
+}
+pid_t WindowManager::spawn_process(const std::string &cmdline) {
+    // `exec` keeps the pid of the client itself, so _NET_WM_PID can be matched against it
+    std::string sh = "exec " + cmdline;
+    // the environment is built before fork(): the child only calls async-signal-safe functions
+    std::vector<std::string> env; // hook context, only meaningful on the thread running the hook
+    if (batch_owner_.load() == std::this_thread::get_id()) env = spawn_env_;
+    std::vector<char*> envp;
+    for (char **e = environ; *e; e++) {
+        const char *eq = strchr(*e, '=');
+        size_t klen = eq ? eq - *e + 1 : strlen(*e);
+        bool overridden = std::any_of(env.begin(), env.end(), [&](const std::string &h) { return h.compare(0, klen, *e, klen) == 0; });
+        if (!overridden) envp.push_back(*e);
+    }
+    for (std::string &e : env) envp.push_back(&e[0]);
+    envp.push_back(nullptr);
+    char *argv[] = {(char*)"sh", (char*)"-c", &sh[0], nullptr};
+    int xfd = xc_.conn() ? xcb_get_file_descriptor(xc_.conn()) : -1;
+    auto t0 = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (xfd >= 0) close(xfd);
+        setsid();
+        execve("/bin/sh", argv, envp.data());
+        _exit(127);
+    }
+    auto now = std::chrono::steady_clock::now();
+    fork_us_.record(std::chrono::duration_cast<std::chrono::microseconds>(now - t0).count());
+    if (pid <= 0) return 0;
+    if (spawned_.size() >= 64) // processes that never map a window (or are not matched)
+        for (auto it = spawned_.begin(); it != spawned_.end();)
+            it = now - it->second > std::chrono::minutes(1) ? spawned_.erase(it) : std::next(it);
+    spawned_[pid] = t0;
+    return pid;
+}
+void WindowManager::cmd_focus_direction(const std::string &dir) {
+    auto lk = lock_state();
+    Workspace &ws = workspace(current_ws_);
+    WindowID n = neighbor(ws, ws.focused, dir);
+    if (!n) return;
+    focus_window(ws, n);
+    xcb_flush(xc_.conn());
+}
+void WindowManager::cmd_move_direction(const std::string &dir) {
+    auto lk = lock_state();
+    Workspace &ws = workspace(current_ws_);
+    WindowID n = neighbor(ws, ws.focused, dir);
+    if (!n) return;
+    Layout &l = layout_for(ws);
+    if (l.snapshot(ws)) l.swap(ws.focused, n, ws);
+    else std::iter_swap(std::find(ws.tiled.begin(), ws.tiled.end(), ws.focused), std::find(ws.tiled.begin(), ws.tiled.end(), n)); // order-based layouts
+    relayout(ws.index);
+}
+void WindowManager::cmd_resize_rel(int dx, int dy) {
+    auto lk = lock_state();
+    WindowID id = focused_window();
+    auto it = windows_.find(id);
+    if (it == windows_.end()) return;
+    if (it->second.floating) {
+        Geometry &g = it->second.geom_floating;
+        g.w = std::max(1, g.w + dx); g.h = std::max(1, g.h + dy);
+        if (it->second.frame) it->second.frame->move_resize(g);
+        return;
+    }
+    Workspace &ws = workspace(it->second.workspace);
+    layout_for(ws).resize(id, dx, dy, ws, monitor_for(ws));
+    relayout(ws.index);
 }
-void WindowManager::cmd_focus_direction(const std::string &dir) { /* TODO */ }
-void WindowManager::cmd_move_direction(const std::string &dir) { /* TODO */ }
-void WindowManager::cmd_resize_rel(int dx, int dy) { /* TODO */ }
 void WindowManager::cmd_toggle_float(WindowID id) { /* TODO */ }
-void WindowManager::cmd_swap(WindowID a, WindowID b) { /* TODO */ }
+void WindowManager::cmd_swap(WindowID a, WindowID b) {
+    auto lk = lock_state();
+    auto ia = windows_.find(a), ib = windows_.find(b);
+    if (ia == windows_.end() || ib == windows_.end() || ia->second.workspace != ib->second.workspace) { sched_.fail("ERR no such windows on one workspace"); return; }
+    Workspace &ws = workspace(ia->second.workspace);
+    if (std::find(ws.tiled.begin(), ws.tiled.end(), a) == ws.tiled.end()
+        || std::find(ws.tiled.begin(), ws.tiled.end(), b) == ws.tiled.end()) { sched_.fail("ERR window not tiled"); return; }
+    layout_for(ws).swap(a, b, ws);
+    relayout(ws.index);
+}
+void WindowManager::cmd_promote(WindowID id) {
+    auto lk = lock_state();
+    if (!id) id = focused_window();
+    auto it = windows_.find(id);
+    if (it == windows_.end()) { sched_.fail("ERR no such window"); return; }
+    Workspace &ws = workspace(it->second.workspace);
+    if (std::find(ws.tiled.begin(), ws.tiled.end(), id) == ws.tiled.end()) { sched_.fail("ERR window not tiled"); return; }
+    layout_for(ws).promote(id, ws, windows_);
+    relayout(ws.index);
+}
+void WindowManager::cmd_set_layout(const std::string &name, int ws) {
+    auto lk = lock_state();
+    if (!layouts_.count(name)) { sched_.fail("ERR unknown layout " + name); return; }
+    Workspace &w = workspace(ws > 0 ? ws : current_ws_);
+    w.layout = name;
+    relayout(w.index);
+    if (w.index == current_ws_ || w.visible) bar_->publish_layout(w.monitor_id, w.index, name);
+}
+void WindowManager::cmd_constraint(int ws, const std::string &op, const std::string &a, const std::string &b) {
+    // constraint <ws> pin <sel> <percent> | equal <sel> <sel> | clear
+    auto lk = lock_state();
+    if (ws <= 0) ws = current_ws_;
+    if (op=="clear") constraint_layout_->clear_constraints(ws);
+    else if (op=="pin") constraint_layout_->add_constraint(ws, {LayoutConstraint::PIN, a, "", atof(b.c_str()) / 100.0});
+    else if (op=="equal") constraint_layout_->add_constraint(ws, {LayoutConstraint::EQUAL, a, b});
+    else { sched_.fail("ERR unknown constraint " + op); return; }
+    relayout(ws);
+}
+void WindowManager::cmd_layout_generator(const std::string &name, const std::string &sockpath, int timeout_ms) {
+    // layout-generator <name> <socket> [timeout_ms]; workspaces opt in with set-layout <name>
+    auto lk = lock_state();
+    if (name.empty() || sockpath.empty() || name=="bsp" || name=="constraint") { sched_.fail("ERR bad layout-generator"); return; }
+    add_layout(std::make_unique<ExternalLayout>(name, sockpath, timeout_ms, *layouts_.at("bsp")));
+    for (auto &p : workspaces_) if (p.second.layout == name) relayout(p.first);
+}
+void WindowManager::cmd_layout_plugin(const std::string &path) {
+    // layout-plugin <path.so>; registered under the plugin's own name
+    auto lk = lock_state();
+    auto pl = std::make_unique<PluginLayout>(path, *layouts_.at("bsp"));
+    if (!pl->load()) { sched_.fail("ERR cannot load " + path); return; }
+    if (layouts_.count(pl->name())) { sched_.fail(std::string("ERR layout ") + pl->name() + " exists"); return; }
+    std::string name = pl->name();
+    add_layout(std::move(pl));
+    for (auto &p : workspaces_) if (p.second.layout == name) relayout(p.first);
+}
+void WindowManager::cmd_container(const std::string &mode) {
+    auto lk = lock_state();
+    Workspace &ws = workspace(current_ws_);
+    auto it = windows_.find(ws.focused);
+    if (it == windows_.end() || it->second.floating) return;
+    int gid = it->second.group;
+    if (mode=="split") {
+        if (gid) { dissolve_group(ws, gid); relayout(ws.index); }
+        return;
+    }
+    if (mode!="tabbed" && mode!="stacked") { sched_.fail("ERR unknown container mode " + mode); return; }
+    if (gid) { ws.groups[gid].stacked = mode=="stacked"; update_tabs(ws, gid); return; }
+    // fold the tiled windows of the workspace into one container around the focused one;
+    // the active children of other containers stay outside (containers do not nest)
+    gid = next_group_++;
+    TabGroup &g = ws.groups[gid];
+    g.stacked = mode=="stacked";
+    std::vector<WindowID> tiled; // what stays in the layout: the container (in the focused slot) and the others
+    for (WindowID id : ws.tiled) {
+        bool fold = id == ws.focused || !windows_[id].group;
+        if (fold) g.children.push_back(id);
+        if (!fold || id == ws.focused) tiled.push_back(id);
+    }
+    g.active = std::find(g.children.begin(), g.children.end(), ws.focused) - g.children.begin();
+    for (WindowID id : g.children) {
+        WmWindow &w = windows_[id];
+        w.group = gid;
+        if (id == ws.focused) continue;
+        w.frame.reset();
+        w.ignore_unmaps++;
+        xc_.sent(xcb_unmap_window(xc_.conn(), id));
+    }
+    ws.tiled = tiled;
+    WmWindow &active = windows_[ws.focused];
+    if (!active.frame) { active.ignore_unmaps++; reparent_to_frame(ws.focused); } // hosts the tab strip
+    relayout(ws.index);
+    update_tabs(ws, gid);
+    xcb_flush(xc_.conn());
+}
+void WindowManager::cmd_tab_cycle(int delta) {
+    auto lk = lock_state();
+    Workspace &ws = workspace(current_ws_);
+    auto it = windows_.find(ws.focused);
+    if (it == windows_.end() || !it->second.group) return;
+    TabGroup &g = ws.groups[it->second.group];
+    size_t n = g.children.size();
+    show_tab(ws, it->second.group, (g.active + n + delta) % n);
+    notify_focus_change();
+    xcb_flush(xc_.conn());
+}
+void WindowManager::cmd_layout_history(const std::string &op, const std::string &name) {
+    // snapshots are shared tree roots, so save/load/undo never copy the layout
+    auto lk = lock_state();
+    Workspace &ws = workspace(current_ws_);
+    if (op=="undo") layout_for(ws).undo(ws);
+    else if (op=="redo") layout_for(ws).redo(ws);
+    else if (op=="save" && !name.empty()) { layout_presets_[name] = layout_for(ws).snapshot(ws); return; }
+    else if (op=="load") {
+        auto it = layout_presets_.find(name);
+        if (it == layout_presets_.end()) { sched_.fail("ERR no layout preset " + name); return; }
+        layout_for(ws).restore(ws, it->second); // windows no longer present are dropped on apply
+    }
+    else return;
+    relayout(ws.index);
+}
 void WindowManager::cmd_send_to_ws(WindowID id, int ws, bool follow) { /* TODO */ }
-void WindowManager::cmd_view_ws(int ws) { current_ws_ = ws; notify_workspace_change(); }
-void WindowManager::cmd_toggle_bar() { bar_->publish_bar_visible(false); /* TODO: toggle */ }
-void WindowManager::cmd_scratch_toggle(const std::string &name) { /* TODO */ }
+void WindowManager::cmd_view_ws(int ws) {
+    XConnection::Op op(xc_, "workspace-switch", XConnection::Op::HOT);
+    auto lk = lock_state();
+    bool changed = current_ws_ != ws;
+    Workspace &w = workspace(ws);
+    if (!w.visible) { // takes the current workspace's monitor; one visible elsewhere is just focused
+        int mon = workspace(current_ws_).monitor_id;
+        bool moved = w.monitor_id != mon;
+        show_on_monitor(ws, mon);
+        if (moved) relayout(ws);
+    }
+    current_ws_ = ws;
+    notify_workspace_change();
+    notify_focus_change();
+    if (changed) fire_hooks("workspace", nullptr, &workspace(ws));
+}
+void WindowManager::cmd_move_ws(int ws, int monitor) {
+    auto lk = lock_state();
+    if (!monitors_.count(monitor)) { sched_.fail("ERR no monitor " + std::to_string(monitor)); return; }
+    show_on_monitor(ws > 0 ? ws : current_ws_, monitor);
+    relayout(ws > 0 ? ws : current_ws_);
+    notify_workspace_change();
+}
+void WindowManager::cmd_toggle_bar() {
+    auto lk = lock_state();
+    bar_visible_ = !bar_visible_;
+    bar_->publish_bar_visible(bar_visible_);
+    if (native_bar_) { native_bar_->set_visible(bar_visible_); update_struts_and_area(); }
+}
+void WindowManager::cmd_bar_option(const std::string &key, const std::string &value) {
+    if (key=="coalesce-ms") bar_->set_interval(std::chrono::milliseconds(std::max(0, atoi(value.c_str()))));
+    else if (key=="native") {
+        auto lk = lock_state();
+        bool on = value=="true" || value=="1";
+        if (on && !native_bar_) {
+            XConnection::Op op(xc_, "bar-create", XConnection::Op::WAITS); // font metrics and atoms, once
+            native_bar_ = new NativeBar(xc_);
+            if (!native_bar_->create(monitors_)) { delete native_bar_; native_bar_ = nullptr; sched_.fail("ERR cannot create the bar"); return; }
+            native_bar_->set_visible(bar_visible_);
+        } else if (!on && native_bar_) {
+            bar_->set_native(nullptr);
+            delete native_bar_; native_bar_ = nullptr;
+        } else return;
+        bar_->set_native(native_bar_);
+        update_struts_and_area();
+    }
+    else if (key=="colors" && native_bar_) { // bar colors <fg> <bg>
+        std::istringstream iss(value); std::string fg, bg; iss>>fg>>bg;
+        native_bar_->set_colors(hex_color_sanitize(fg), hex_color_sanitize(bg));
+        bar_->set_native(native_bar_); // forces a repaint
+    }
+    else bar_->set_format_option(key, value);
+}
+void WindowManager::cmd_set_workspaces(const std::vector<std::string> &defs) {
+    std::map<int, std::string> names;
+    for (const std::string &d : defs) {
+        int idx = atoi(d.c_str());
+        if (idx <= 0) continue;
+        size_t colon = d.find(':');
+        names[idx] = colon == std::string::npos ? d : d.substr(colon+1);
+    }
+    bar_->set_workspace_names(names);
+}
+void WindowManager::cmd_scratch_define(const std::string &def) {
+    size_t colon = def.find(':');
+    if (colon == std::string::npos || colon == 0) { sched_.fail("ERR scratch <name>:<command>"); return; }
+    auto lk = lock_state();
+    Scratchpad &sp = scratchpads_[def.substr(0, colon)];
+    sp.cmd = def.substr(colon+1);
+    if (!sp.win && !sp.pid) sp.pid = spawn_process(sp.cmd); // pre-spawn, parked on adoption
+}
+void WindowManager::cmd_scratch_toggle(const std::string &name) {
+    auto lk = lock_state();
+    auto it = scratchpads_.find(name);
+    if (it == scratchpads_.end()) { sched_.fail("ERR no scratchpad " + name); return; }
+    Scratchpad &sp = it->second;
+    if (!sp.win) {
+        // never spawned, or its window went away: start it now and show it once it maps
+        if (!sp.pid || kill(sp.pid, 0) != 0) sp.pid = spawn_process(sp.cmd);
+        sp.show_on_adopt = true;
+        return;
+    }
+    WmWindow &w = windows_[sp.win];
+    if (sp.shown) {
+        sp.geom[workspace(current_ws_).monitor_id] = w.geom_floating;
+        if (w.frame && w.frame->frame_win()) xc_.sent(xcb_unmap_window(xc_.conn(), w.frame->frame_win()));
+        else { w.ignore_unmaps++; xc_.sent(xcb_unmap_window(xc_.conn(), sp.win)); }
+        sp.shown = false;
+        Workspace &ws = workspace(current_ws_);
+        focus_window(ws, ws.focused);
+    } else {
+        show_scratchpad(sp);
+    }
+    xcb_flush(xc_.conn());
+}
+void WindowManager::show_scratchpad(Scratchpad &sp) {
+    WmWindow &w = windows_[sp.win];
+    int mon = workspace(current_ws_).monitor_id;
+    auto g = sp.geom.find(mon);
+    if (g != sp.geom.end()) w.geom_floating = g->second;
+    else {
+        const Monitor &m = monitor_for(workspace(current_ws_));
+        w.geom_floating = Geometry{m.x + m.w/5, m.y + m.h/6, m.w*3/5, m.h/2};
+    }
+    // one batch: position, raise, map, focus; the caller flushes once
+    xcb_connection_t *c = xc_.conn();
+    xcb_window_t top = sp.win;
+    if (w.frame && w.frame->frame_win()) { w.frame->move_resize(w.geom_floating); top = w.frame->frame_win(); }
+    else {
+        const Geometry &fg = w.geom_floating;
+        uint32_t vals[] = {(uint32_t)fg.x, (uint32_t)fg.y, (uint32_t)fg.w, (uint32_t)fg.h};
+        xc_.sent(xcb_configure_window(c, sp.win, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT, vals));
+    }
+    uint32_t above = XCB_STACK_MODE_ABOVE;
+    xc_.sent(xcb_configure_window(c, top, XCB_CONFIG_WINDOW_STACK_MODE, &above));
+    xc_.sent(xcb_map_window(c, top));
+    xc_.sent(xcb_set_input_focus(c, XCB_INPUT_FOCUS_POINTER_ROOT, sp.win, XCB_CURRENT_TIME));
+    sp.shown = true;
+}
+bool WindowManager::adopt_scratchpad(WmWindow &w) {
+    if (!w.pid) return false;
+    for (auto &p : scratchpads_) {
+        Scratchpad &sp = p.second;
+        if (sp.win || sp.pid != w.pid) continue;
+        sp.win = w.id;
+        w.scratch = true; w.floating = true; w.workspace = 0;
+        if (sp.show_on_adopt) { sp.show_on_adopt = false; show_scratchpad(sp); xcb_flush(xc_.conn()); }
+        return true;
+    }
+    return false;
+}
 void WindowManager::cmd_set_border(BorderType type, int width) { /* TODO: update frames */ }
 void WindowManager::cmd_set_color(BorderType type, const std::string &hex) { /* TODO: update frames */ }
-void WindowManager::cmd_reload_config() { cfg_->run_once(); }
+void WindowManager::cmd_reload_config() {
+    if (cfg_) cfg_->reload();
+}
 void WindowManager::cmd_quit() { stop(); }
 
 // Event handlers
 void WindowManager::handle_map_request(xcb_map_request_event_t *ev) {
-    WindowID id = ev->window;
-    // adopt window and map
-    adopt_new_window(id);
+    // adopt window (or dock) and map
+    adopt_new_window(ev->window);
+}
+WindowManager::DockCookies WindowManager::request_dock(WindowID id) {
+    xcb_connection_t *c = xc_.conn();
+    return DockCookies{xc_.sent(xcb_get_property(c, 0, id, xc_.atom("_NET_WM_WINDOW_TYPE"), XCB_ATOM_ATOM, 0, 8)),
+                       xc_.sent(xcb_get_property(c, 0, id, xc_.atom("_NET_WM_STRUT_PARTIAL"), XCB_ATOM_CARDINAL, 0, 12)),
+                       xc_.sent(xcb_get_property(c, 0, id, xc_.atom("_NET_WM_STRUT"), XCB_ATOM_CARDINAL, 0, 4))};
+}
+bool WindowManager::adopt_dock(WindowID id, const DockCookies &ck) {
+    xcb_connection_t *c = xc_.conn();
+    xcb_atom_t type_dock = xc_.atom("_NET_WM_WINDOW_TYPE_DOCK");
+    bool dock = false;
+    std::array<uint32_t, 12> st{};
+    if (xcb_get_property_reply_t *r = xcb_get_property_reply(c, ck.type, nullptr)) {
+        const xcb_atom_t *a = (const xcb_atom_t*)xcb_get_property_value(r), *end = a + xcb_get_property_value_length(r) / 4;
+        dock = std::find(a, end, type_dock) != end;
+        free(r);
+    }
+    xcb_get_property_reply_t *rp = xcb_get_property_reply(c, ck.partial, nullptr), *rs = xcb_get_property_reply(c, ck.strut, nullptr);
+    if (rp && xcb_get_property_value_length(rp) >= 12 * 4) {
+        memcpy(st.data(), xcb_get_property_value(rp), sizeof(st)); dock = true;
+    } else if (rs && xcb_get_property_value_length(rs) >= 4 * 4) {
+        // plain _NET_WM_STRUT reserves whole edges
+        memcpy(st.data(), xcb_get_property_value(rs), 4 * 4); dock = true;
+        for (int i = 4; i < 12; i += 2) st[i+1] = UINT32_MAX;
+    }
+    free(rp); free(rs);
+    if (!dock) return false;
+    struts_[id] = st;
+    xc_.sent(xcb_map_window(c, id));
+    update_struts_and_area();
+    xcb_flush(c);
+    return true;
 }
 void WindowManager::handle_unmap_notify(xcb_unmap_notify_event_t *ev) {
+    {
+        auto lk = lock_state();
+        auto it = windows_.find(ev->window);
+        if (it != windows_.end() && it->second.ignore_unmaps > 0) { it->second.ignore_unmaps--; return; }
+        if (struts_.erase(ev->window)) { update_struts_and_area(); return; }
+    }
+    remove_window(ev->window);
+}
+void WindowManager::handle_destroy_notify(xcb_destroy_notify_event_t *ev) {
+    // windows that die unmapped (hidden tabs, parked scratchpads) send no UnmapNotify;
+    // for the others the UnmapNotify already removed them and this is a no-op
+    {
+        auto lk = lock_state();
+        if (struts_.erase(ev->window)) { update_struts_and_area(); return; }
+    }
     remove_window(ev->window);
 }
 void WindowManager::handle_configure_request(xcb_configure_request_event_t *ev) {
@@ -710,19 +4564,288 @@ void WindowManager::handle_button_press(xcb_button_press_event_t *ev) {
 
 // Helpers
 void WindowManager::adopt_new_window(WindowID id) {
-    std::unique_lock<std::shared_mutex> lk(state_mtx_);
-    WmWindow w; w.id = id;
-    // TODO: query WM_CLASS/title and apply RulesEngine; reparent by creating Frame
-    windows_[id] = std::move(w);
+    auto lk = lock_state();
+    WmWindow w; w.id = id; w.workspace = current_ws_;
+    // TODO: reparent by creating Frame
+    // one round trip for everything read about the window: all requests, then the replies
+    // (the atoms are interned once, on the first map)
+    xc_.intern({"_NET_WM_PID", "_NET_WM_NAME", "_NET_WM_WINDOW_TYPE", "_NET_WM_WINDOW_TYPE_DOCK", "_NET_WM_STRUT_PARTIAL", "_NET_WM_STRUT"});
+    DockCookies ck_dock = request_dock(id);
+    auto ck_pid = xc_.request_cardinal(id, xc_.atom("_NET_WM_PID"));
+    auto ck_class = xc_.request_text(id, XCB_ATOM_WM_CLASS);
+    auto ck_net_name = xc_.request_text(id, xc_.atom("_NET_WM_NAME"));
+    auto ck_name = xc_.request_text(id, XCB_ATOM_WM_NAME);
+    auto ck_hints = xc_.request_size_hints(id);
+    xc_.round_trip();
+    if (adopt_dock(id, ck_dock)) {
+        for (auto ck : {ck_pid, ck_class, ck_net_name, ck_name, ck_hints}) xcb_discard_reply(xc_.conn(), ck.sequence);
+        return;
+    }
+    if (auto pid = xc_.cardinal_reply(ck_pid)) w.pid = (pid_t)*pid;
+    auto sp = spawned_.find(w.pid);
+    if (w.pid && sp != spawned_.end()) {
+        map_us_.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - sp->second).count());
+        spawned_.erase(sp);
+    }
+    std::string wm_class = xc_.text_reply(ck_class); // "instance\0class\0"
+    size_t nul = wm_class.find('\0');
+    if (nul != std::string::npos) w.cls = wm_class.substr(nul+1, wm_class.find('\0', nul+1) - nul - 1);
+    w.title = xc_.text_reply(ck_net_name);
+    std::string name = xc_.text_reply(ck_name); // every reply is collected, even when unused
+    if (w.title.empty()) w.title = name;
+    w.hints = xc_.size_hints_reply(ck_hints);
+    if (adopt_scratchpad(w)) { index_.update(windows_[id] = std::move(w)); return; } // parked, stays unmapped
+    // rule actions pick the workspace (or the one visible on a monitor) and floating
+    auto rule = rules_.match(id, w);
+    int target = current_ws_;
+    if (rule && rule->workspace && *rule->workspace > 0) target = *rule->workspace;
+    else if (rule && rule->monitor_id)
+        for (auto &p : workspaces_) if (p.second.visible && p.second.monitor_id == *rule->monitor_id) { target = p.first; break; }
+    w.workspace = target;
+    if (rule && rule->floating) w.floating = *rule->floating;
+    WmWindow &nw = windows_[id] = std::move(w);
+    index_.update(nw);
+    Workspace &ws = workspace(target);
+    auto fit = windows_.find(ws.focused);
+    if (nw.floating) {
+        // area=<x>,<y>,<w>,<h> in percent of the monitor, centred 60% by default
+        int a[4] = {20, 20, 60, 60};
+        if (rule && rule->area) sscanf(rule->area->c_str(), "%d,%d,%d,%d", &a[0], &a[1], &a[2], &a[3]);
+        const Monitor &m = monitor_for(ws);
+        nw.geom_floating = Geometry{m.x + m.w * a[0] / 100, m.y + m.h * a[1] / 100, std::max(1, m.w * a[2] / 100), std::max(1, m.h * a[3] / 100)};
+        if (nw.frame) nw.frame->move_resize(nw.geom_floating);
+        else {
+            const Geometry &fg = nw.geom_floating;
+            uint32_t vals[] = {(uint32_t)fg.x, (uint32_t)fg.y, (uint32_t)fg.w, (uint32_t)fg.h};
+            xc_.sent(xcb_configure_window(xc_.conn(), id, XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT, vals));
+        }
+        ws.floating.push_back(id);
+    } else if (fit != windows_.end() && fit->second.group) {
+        // opened from inside a container: becomes its active tab, the layout is untouched
+        int gid = fit->second.group;
+        TabGroup &g = ws.groups[gid];
+        g.children.push_back(id);
+        windows_[id].group = gid;
+        show_tab(ws, gid, g.children.size()-1);
+        notify_focus_change();
+        fire_hooks("map", &windows_[id], &ws);
+        return;
+    } else {
+        ws.tiled.push_back(id);
+        relayout(ws.index); // new leaf splits the focused one, so focus moves afterwards
+    }
+    ws.focused = id;
+    notify_workspace_change();
+    notify_focus_change();
+    if (rule && rule->macro) run_macro(*rule->macro);
+    auto wit = windows_.find(id); // the macro may have closed it
+    if (wit != windows_.end()) fire_hooks("map", &wit->second, &workspace(wit->second.workspace));
+}
+void WindowManager::reparent_to_frame(WindowID id) {
+    WmWindow &w = windows_[id];
+    if (w.frame) return;
+    w.frame = std::make_unique<Frame>(xc_, id);
+    w.frame->create();
+}
+void WindowManager::remove_window(WindowID id) {
+    auto lk = lock_state();
+    auto it = windows_.find(id);
+    if (it == windows_.end()) return;
+    auto wsit = workspaces_.find(it->second.workspace);
+    fire_hooks("unmap", &it->second, wsit != workspaces_.end() ? &wsit->second : nullptr);
+    index_.remove(id);
+    if (it->second.scratch) {
+        // the client exited (a parked one only reports DestroyNotify): the entry forgets its
+        // window and process, so the next toggle spawns it again
+        bool shown = false;
+        for (auto &p : scratchpads_) {
+            Scratchpad &sp = p.second;
+            if (sp.win != id) continue;
+            shown = sp.shown;
+            sp.win = 0; sp.pid = 0; sp.shown = false; sp.show_on_adopt = false;
+        }
+        windows_.erase(it);
+        if (shown) { Workspace &ws = workspace(current_ws_); focus_window(ws, ws.focused); xcb_flush(xc_.conn()); }
+        return;
+    }
+    Workspace &ws = workspace(it->second.workspace);
+    if (int gid = it->second.group) {
+        TabGroup &g = ws.groups[gid];
+        size_t idx = std::find(g.children.begin(), g.children.end(), id) - g.children.begin();
+        if (idx == g.active && g.children.size() > 1) show_tab(ws, gid, idx ? idx-1 : 1, true); // a sibling, never the departing one
+        g.children.erase(g.children.begin() + idx);
+        if (g.active > idx) g.active--;
+        windows_.erase(it);
+        if (g.children.size() == 1) dissolve_group(ws, gid);
+        else update_tabs(ws, gid);
+        notify_focus_change();
+        return; // the container keeps its slot: no relayout
+    }
+    ws.tiled.erase(std::remove(ws.tiled.begin(), ws.tiled.end(), id), ws.tiled.end());
+    ws.floating.erase(std::remove(ws.floating.begin(), ws.floating.end(), id), ws.floating.end());
+    if (ws.focused == id) ws.focused = ws.tiled.empty() ? 0 : ws.tiled.back();
+    windows_.erase(it);
+    relayout(ws.index);
+    notify_workspace_change();
+    notify_focus_change();
+}
+Workspace &WindowManager::workspace(int index) {
+    Workspace &ws = workspaces_[index];
+    ws.index = index;
+    return ws;
+}
+void WindowManager::show_on_monitor(int index, int monitor) {
+    for (auto &p : workspaces_)
+        if (p.first != index && p.second.visible && p.second.monitor_id == monitor) p.second.visible = false;
+    Workspace &ws = workspace(index);
+    ws.monitor_id = monitor;
+    ws.visible = true;
+}
+const Monitor &WindowManager::monitor_for(const Workspace &ws) {
+    auto it = monitors_.find(ws.monitor_id);
+    return it != monitors_.end() ? it->second : monitors_.begin()->second;
+}
+void WindowManager::show_tab(Workspace &ws, int gid, size_t idx, bool old_gone) {
+    TabGroup &g = ws.groups[gid];
+    WindowID old = g.children[g.active], now = g.children[idx];
+    g.active = idx;
+    ws.focused = now;
+    if (old == now) { update_tabs(ws, gid); return; }
+    WmWindow &wo = windows_[old], &wn = windows_[now];
+    std::replace(ws.tiled.begin(), ws.tiled.end(), old, now);
+    layout_for(ws).replace(old, now, ws);
+    wn.geom_tiled = wo.geom_tiled;
+    std::swap(wn.frame, wo.frame); // the frame follows the active child
+    if (!old_gone) wo.ignore_unmaps++; // a departing child is neither unmapped nor waited for
+    if (wn.frame) wn.frame->set_client(now, !old_gone);
+    else {
+        if (!old_gone) xc_.sent(xcb_unmap_window(xc_.conn(), old));
+        xc_.sent(xcb_map_window(xc_.conn(), now));
+    }
+    update_tabs(ws, gid);
+}
+void WindowManager::update_tabs(Workspace &ws, int gid) {
+    TabGroup &g = ws.groups[gid];
+    auto it = windows_.find(g.children[g.active]);
+    if (it == windows_.end() || !it->second.frame) return;
+    std::vector<std::string> titles;
+    for (WindowID id : g.children) titles.push_back(windows_[id].title);
+    it->second.frame->set_tabs(titles, g.active, g.stacked);
+}
+void WindowManager::dissolve_group(Workspace &ws, int gid) {
+    TabGroup g = std::move(ws.groups[gid]);
+    ws.groups.erase(gid);
+    WindowID active = g.children[g.active];
+    auto pos = std::find(ws.tiled.begin(), ws.tiled.end(), active);
+    bool framed = (bool)windows_[active].frame; // the others gave theirs up in cmd_container
+    for (WindowID id : g.children) {
+        WmWindow &w = windows_[id];
+        w.group = 0;
+        if (id == active) { if (w.frame) w.frame->set_tabs({}, 0, false); continue; }
+        if (framed) reparent_to_frame(id);
+        if (w.frame && w.frame->frame_win()) xc_.sent(xcb_map_window(xc_.conn(), w.frame->frame_win()));
+        xc_.sent(xcb_map_window(xc_.conn(), id));
+        pos = ws.tiled.insert(pos + 1, id);
+    }
+}
+Layout &WindowManager::layout_for(const Workspace &ws) {
+    auto it = layouts_.find(ws.layout);
+    return it != layouts_.end() ? *it->second : *layouts_.at("bsp");
+}
+void WindowManager::add_layout(std::unique_ptr<Layout> l) {
+    std::string name = l->name();
+    layouts_[name] = std::move(l);
+}
+WindowID WindowManager::focused_window() {
+    auto it = workspaces_.find(current_ws_);
+    return it == workspaces_.end() ? 0 : it->second.focused;
+}
+void WindowManager::relayout(int index) {
+    if (batch_owner_.load() == std::this_thread::get_id()) { deferred_relayout_.insert(index); return; }
+    Workspace &ws = workspace(index);
+    if (monitors_.empty()) return;
+    XConnection::Op op(xc_, "relayout", XConnection::Op::HOT);
+    TRACE_SPAN_D("relayout", std::to_string(index));
+    auto t0 = std::chrono::steady_clock::now();
+    {
+        TRACE_SPAN_D("Layout::apply", ws.layout);
+        layout_for(ws).apply(ws, windows_, monitor_for(ws));
+    }
+    flight_.record(HWM_FL_LAYOUT, index, ws.tiled.size(), ws.layout);
+    for (WindowID id : ws.tiled) {
+        auto it = windows_.find(id);
+        if (it != windows_.end() && it->second.frame && !it->second.fullscreen)
+            it->second.frame->move_resize(it->second.geom_tiled);
+    }
+    relayout_us_.record(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count());
+}
+void WindowManager::update_struts_and_area() {
+    int top = native_bar_ && bar_visible_ ? native_bar_->height() : 0;
+    long W = xc_.screen()->width_in_pixels, H = xc_.screen()->height_in_pixels;
+    for (auto &p : monitors_) {
+        Monitor &m = p.second;
+        const Geometry &g = m.screen;
+        // struts count from the root window's edges; one only applies to the monitors its
+        // start/end range crosses and that actually reach into it
+        auto crosses = [](uint32_t lo, uint32_t hi, long from, long len) { return (long)lo < from + len && (long)hi >= from; };
+        long l = 0, r = 0, t = top, b = 0;
+        for (auto &d : struts_) {
+            const std::array<uint32_t, 12> &s = d.second;
+            if (s[0] && crosses(s[4], s[5], g.y, g.h)) l = std::max(l, (long)s[0] - g.x);
+            if (s[1] && crosses(s[6], s[7], g.y, g.h)) r = std::max(r, g.x + g.w - (W - (long)s[1]));
+            if (s[2] && crosses(s[8], s[9], g.x, g.w)) t = std::max(t, (long)s[2] - g.y);
+            if (s[3] && crosses(s[10], s[11], g.x, g.w)) b = std::max(b, g.y + g.h - (H - (long)s[3]));
+        }
+        l = std::min<long>(l, g.w / 2); r = std::min<long>(r, g.w / 2);
+        t = std::min<long>(t, g.h / 2); b = std::min<long>(b, g.h / 2);
+        m.x = g.x + l; m.y = g.y + t; m.w = g.w - l - r; m.h = g.h - t - b;
+    }
+    for (auto &p : workspaces_) if (p.first == current_ws_ || p.second.visible) relayout(p.first);
+}
+void WindowManager::notify_focus_change() {
+    auto it = workspaces_.find(current_ws_);
+    auto wit = windows_.find(it != workspaces_.end() ? it->second.focused : 0);
+    if (wit == windows_.end()) bar_->publish_focus(0, "");
+    else bar_->publish_focus(wit->first, wit->second.title);
+    WindowID now = wit == windows_.end() ? 0 : wit->first;
+    if (now != hook_focus_) {
+        hook_focus_ = now;
+        fire_hooks("focus", now ? &wit->second : nullptr, it != workspaces_.end() ? &it->second : nullptr);
+    }
+}
+void WindowManager::focus_window(Workspace &ws, WindowID id) {
+    ws.focused = id;
+    xc_.sent(xcb_set_input_focus(xc_.conn(), XCB_INPUT_FOCUS_POINTER_ROOT, id ? id : xc_.root(), XCB_CURRENT_TIME));
+    notify_focus_change();
+}
+WindowID WindowManager::neighbor(const Workspace &ws, WindowID id, const std::string &dir) {
+    // by window centres: must lie ahead in `dir`; the nearest wins, drift across it counts double
+    int dx = dir=="left" ? -1 : dir=="right" ? 1 : 0, dy = dir=="up" ? -1 : dir=="down" ? 1 : 0;
+    auto it = windows_.find(id);
+    if ((!dx && !dy) || it == windows_.end()) return 0;
+    const Geometry &g = it->second.geom_tiled;
+    long cx = g.x + g.w/2, cy = g.y + g.h/2;
+    WindowID best = 0;
+    long best_d = LONG_MAX;
+    for (WindowID o : ws.tiled) {
+        auto ot = windows_.find(o);
+        if (o == id || ot == windows_.end()) continue;
+        const Geometry &h = ot->second.geom_tiled;
+        long ox = h.x + h.w/2 - cx, oy = h.y + h.h/2 - cy;
+        long along = dx ? ox * dx : oy * dy, across = std::labs(dx ? oy : ox);
+        if (along <= 0) continue;
+        long d = along + 2 * across;
+        if (d < best_d) { best_d = d; best = o; }
+    }
+    return best;
 }
-void WindowManager::reparent_to_frame(WindowID id) { /* TODO */ }
-void WindowManager::remove_window(WindowID id) { std::unique_lock<std::shared_mutex> lk(state_mtx_); windows_.erase(id); }
-void WindowManager::update_struts_and_area() { /* TODO: update EWMH _NET_WM_STRUT etc */ }
 void WindowManager::notify_workspace_change() { 
     // compute occupied
     std::vector<int> occ; 
     for (auto &p : workspaces_) if (!p.second.tiled.empty() || !p.second.floating.empty()) occ.push_back(p.first);
     bar_->publish_workspace(current_ws_, occ);
+    auto it = workspaces_.find(current_ws_);
+    if (it != workspaces_.end()) bar_->publish_layout(it->second.monitor_id, current_ws_, it->second.layout);
 }
 
 // -----------------------------
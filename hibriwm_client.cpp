@@ -0,0 +1,147 @@
+// hibriwm_client.cpp
+// Client library for the WM's IPC socket (see hibriwm_client.h)
+
+#include "hibriwm_client.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+std::string hwm_socket_path() {
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    return std::string(dir && *dir ? dir : "/tmp") + "/mywm.sock";
+}
+
+HwmClient::~HwmClient() { close(); }
+
+bool HwmClient::connect(const std::string &path) {
+    close();
+    fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd_ < 0) return false;
+    sockaddr_un addr; memset(&addr,0,sizeof(addr)); addr.sun_family = AF_UNIX; strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path)-1);
+    if (::connect(fd_, (sockaddr*)&addr, sizeof(addr)) < 0) { close(); return false; }
+    return true;
+}
+
+void HwmClient::close() {
+    if (fd_ >= 0) ::close(fd_);
+    fd_ = -1;
+    out_.clear(); in_.clear(); inflight_.clear();
+}
+
+std::optional<std::string> HwmClient::command(const std::string &line) {
+    sync_reply_.reset();
+    send(line, [this](uint64_t, const std::string &r) { sync_reply_ = r; });
+    if (!flush()) return std::nullopt;
+    while (!sync_reply_)
+        if (poll_replies(-1) < 0) return std::nullopt;
+    return sync_reply_;
+}
+
+uint64_t HwmClient::send(const std::string &line, ReplyCallback cb) {
+    uint64_t id = next_id_++;
+    out_ += "#" + std::to_string(id) + " " + line + "\n";
+    inflight_.push_back(Pending{id, std::move(cb)});
+    if (out_.size() >= FLUSH_AT) flush();
+    return id;
+}
+
+bool HwmClient::flush() {
+    // Replies are read while writing: the server answers each line as it goes, and a
+    // long pipelined batch would otherwise fill both socket buffers and deadlock.
+    size_t off = 0;
+    while (fd_ >= 0 && off < out_.size()) {
+        pollfd p{fd_, POLLOUT | POLLIN, 0};
+        if (poll(&p, 1, -1) < 0) { if (errno == EINTR) continue; return false; }
+        if (p.revents & POLLIN) {
+            if (!read_some(0)) return false;
+            dispatch_lines();
+        }
+        if (p.revents & (POLLERR | POLLHUP)) { close(); return false; }
+        if (p.revents & POLLOUT) {
+            ssize_t w = ::send(fd_, out_.data() + off, out_.size() - off, MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (w < 0 && errno != EAGAIN && errno != EINTR) { close(); return false; }
+            if (w > 0) off += w;
+        }
+    }
+    out_.erase(0, off);
+    return fd_ >= 0;
+}
+
+int HwmClient::poll_replies(int timeout_ms) {
+    if (fd_ < 0) return -1;
+    int n = dispatch_lines(); // lines already buffered by flush()
+    if (n > 0) return n;
+    if (!read_some(timeout_ms)) return -1;
+    return dispatch_lines();
+}
+
+bool HwmClient::drain() {
+    if (!flush()) return false;
+    while (!inflight_.empty())
+        if (poll_replies(-1) < 0) return false;
+    return true;
+}
+
+bool HwmClient::subscribe(const std::string &args, const LineCallback &on_line) {
+    if (fd_ < 0 || !inflight_.empty()) return false;
+    out_ += "subscribe" + (args.empty() ? std::string() : " " + args) + "\n";
+    if (!flush()) return false;
+    for (;;) {
+        size_t pos;
+        while ((pos = in_.find('\n')) != std::string::npos) {
+            std::string line = in_.substr(0, pos);
+            in_.erase(0, pos+1);
+            if (!on_line(line)) return true;
+        }
+        if (!read_some(-1)) return false;
+    }
+}
+
+bool HwmClient::read_some(int timeout_ms) {
+    pollfd p{fd_, POLLIN, 0};
+    int r;
+    while ((r = poll(&p, 1, timeout_ms)) < 0 && errno == EINTR) {}
+    if (r < 0) { close(); return false; }
+    if (r == 0) return true; // timeout
+    char buf[16384];
+    ssize_t n;
+    while ((n = read(fd_, buf, sizeof(buf))) < 0 && errno == EINTR) {}
+    if (n <= 0) { close(); return false; }
+    in_.append(buf, n);
+    return true;
+}
+
+int HwmClient::dispatch_lines() {
+    int n = 0;
+    size_t pos;
+    while (!inflight_.empty() && (pos = in_.find('\n')) != std::string::npos) {
+        // replies come back in request order; the id prefix is only checked, not searched
+        uint64_t id = inflight_.front().id;
+        size_t start = 0;
+        if (in_.size() > 1 && in_[0] == '#' && isdigit((unsigned char)in_[1])) {
+            char *end;
+            uint64_t got = strtoull(in_.c_str()+1, &end, 10);
+            if (got != id) { in_.erase(0, pos+1); continue; } // not ours (e.g. a line from an older session)
+            start = end - in_.c_str() + (*end == ' ');
+        }
+        if (in_.compare(start, 2, "# ") == 0 && in_.compare(start, 6, "# EOF\n") != 0) {
+            // text block (metrics exposition): the reply runs up to its "# EOF" line
+            size_t eof = in_.find("\n# EOF\n", start);
+            if (eof == std::string::npos) break; // rest not read yet
+            pos = eof + 6;
+        }
+        std::string line = in_.substr(start, pos - start);
+        in_.erase(0, pos+1);
+        Pending p = std::move(inflight_.front());
+        inflight_.pop_front();
+        if (p.cb) p.cb(id, line);
+        n++;
+    }
+    return n;
+}
@@ -0,0 +1,78 @@
+/* hibriwm_client.h
+ * Client library for the WM's IPC socket: one persistent connection, synchronous and
+ * pipelined (asynchronous) commands, and event subscriptions.
+ *
+ * Protocol: one command per line. A line may start with "#<id> ", in which case the
+ * reply line starts with the same "#<id> "; replies always come back in request order.
+ * A reply is "OK", "ERR <reason>" or, for commands that answer with data, the data
+ * itself on one line. The exception are text blocks (`query metrics format=prometheus`):
+ * a reply starting with "# " spans several lines, up to and including a "# EOF" line.
+ *
+ * Build (example):
+ *   g++ -O2 -c hibriwm_client.cpp && ar rcs libhibriwm_client.a hibriwm_client.o
+ *   g++ -O2 wmctl.cpp -L. -lhibriwm_client -o wmctl
+ *
+ * Not thread-safe: use one HwmClient per thread.
+ */
+#ifndef HIBRIWM_CLIENT_H
+#define HIBRIWM_CLIENT_H
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <string>
+
+// ${XDG_RUNTIME_DIR:-/tmp}/mywm.sock, the path the WM listens on
+std::string hwm_socket_path();
+
+class HwmClient {
+public:
+    using ReplyCallback = std::function<void(uint64_t id, const std::string &reply)>;
+    using LineCallback = std::function<bool(const std::string &line)>; // false stops the stream
+
+    HwmClient() = default;
+    ~HwmClient();
+    HwmClient(const HwmClient&) = delete;
+    HwmClient &operator=(const HwmClient&) = delete;
+
+    bool connect(const std::string &path = hwm_socket_path());
+    void close();
+    bool connected() const { return fd_ >= 0; }
+    int fd() const { return fd_; }
+
+    // Sends one command and waits for its reply; replies to earlier async requests
+    // arriving first are dispatched to their callbacks. nullopt if the connection failed.
+    std::optional<std::string> command(const std::string &line);
+
+    // Queues a command without waiting and returns its request id. Requests are buffered
+    // until flush() (or until the buffer grows large), so a batch costs one write.
+    uint64_t send(const std::string &line, ReplyCallback cb = {});
+    bool flush();
+    // Reads available replies, waiting up to timeout_ms (-1 = until one arrives), and
+    // dispatches them. Returns the number dispatched, or -1 if the connection failed.
+    int poll_replies(int timeout_ms);
+    // flush() + poll_replies() until no request is outstanding.
+    bool drain();
+    size_t pending() const { return inflight_.size(); }
+
+    // Sends `subscribe <args>` and calls on_line for every line received until it returns
+    // false or the connection closes. Must not have requests in flight.
+    bool subscribe(const std::string &args, const LineCallback &on_line);
+
+private:
+    struct Pending { uint64_t id; ReplyCallback cb; };
+    static constexpr size_t FLUSH_AT = 64 * 1024;
+
+    int fd_ = -1;
+    uint64_t next_id_ = 1;
+    std::string out_;  // queued request lines
+    std::string in_;   // partial reply line
+    std::deque<Pending> inflight_;
+    std::optional<std::string> sync_reply_; // reply slot of command()
+
+    bool read_some(int timeout_ms);
+    int dispatch_lines();
+};
+
+#endif /* HIBRIWM_CLIENT_H */
@@ -0,0 +1,100 @@
+/* hibriwm_flight.h
+ * Flight recorder: a fixed-size ring of binary records (X events, commands, layout
+ * decisions, stalls) kept in a memory-mapped file, so the last few thousand things the
+ * WM did are still on disk after it crashes or is killed while hung.
+ *
+ * The WM writes ${XDG_RUNTIME_DIR:-/tmp}/hibriwm.flight; on startup the previous file is
+ * renamed to hibriwm.flight.old, so a restart does not erase the record of the crash.
+ * Decode either with hwm_flightdump.
+ *
+ * Any thread may append (hwm_flight_append): a slot is claimed with one atomic add on
+ * `head`, and `seq` marks it complete, so a reader (or a crash in the middle of a write)
+ * never yields a torn record; hwm_flight_read() reports such slots as missing.
+ */
+#ifndef HIBRIWM_FLIGHT_H
+#define HIBRIWM_FLIGHT_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HIBRIWM_FLIGHT_MAGIC   0x48574d46u /* "HWMF" */
+#define HIBRIWM_FLIGHT_VERSION 1u
+#define HWM_FLIGHT_TEXT        88
+
+enum hwm_flight_kind {
+    HWM_FL_START = 1,   /* a = pid; text = "hibriwm" */
+    HWM_FL_EVENT = 2,   /* a = X event type, b = window (or keycode | state << 8) */
+    HWM_FL_COMMAND = 3, /* a = IPC request id (0 = none), b = scheduler class; text = command line */
+    HWM_FL_LAYOUT = 4,  /* a = workspace, b = tiled windows; text = layout name */
+    HWM_FL_STALL = 5,   /* a = stalled for (us), b = line of the report; text = line 0: what the
+                           main loop was running (phase, event, command), then one stack frame each */
+    HWM_FL_NOTE = 6     /* text = free-form */
+};
+
+typedef struct hwm_flight_rec {
+    uint64_t seq;          /* index + 1 once written, 0 while being written */
+    uint64_t time_ns;      /* CLOCK_MONOTONIC */
+    uint16_t kind;         /* enum hwm_flight_kind */
+    uint16_t len;          /* text bytes */
+    uint32_t xseq;         /* last X request sequence number when recorded */
+    uint64_t a, b;         /* see enum hwm_flight_kind */
+    char text[HWM_FLIGHT_TEXT]; /* not NUL-terminated, cut at HWM_FLIGHT_TEXT */
+} hwm_flight_rec_t;        /* 128 bytes */
+
+typedef struct hwm_flight {
+    uint32_t magic;        /* HIBRIWM_FLIGHT_MAGIC */
+    uint32_t version;      /* HIBRIWM_FLIGHT_VERSION */
+    uint32_t nrecs;        /* power of two */
+    uint32_t pid;
+    uint64_t head;         /* index of the next record to be claimed */
+    uint64_t mono_ns;      /* CLOCK_MONOTONIC and CLOCK_REALTIME taken together at */
+    uint64_t real_ns;      /* creation: turns time_ns into wall-clock time */
+    uint64_t pad[3];       /* keeps records cache-line aligned */
+    hwm_flight_rec_t recs[];
+} hwm_flight_t;
+
+static inline uint64_t hwm_flight_clock(clockid_t clk)
+{
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline void hwm_flight_append(hwm_flight_t *f, uint16_t kind, uint32_t xseq, uint64_t a, uint64_t b,
+                                     const char *text, size_t len)
+{
+    uint64_t i = __atomic_fetch_add(&f->head, 1, __ATOMIC_RELAXED);
+    hwm_flight_rec_t *r = &f->recs[i & (f->nrecs - 1)];
+    __atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    r->time_ns = hwm_flight_clock(CLOCK_MONOTONIC);
+    r->kind = kind;
+    r->len = (uint16_t)(len < HWM_FLIGHT_TEXT ? len : HWM_FLIGHT_TEXT);
+    r->xseq = xseq;
+    r->a = a; r->b = b;
+    if (r->len) memcpy(r->text, text, r->len);
+    __atomic_store_n(&r->seq, i + 1, __ATOMIC_RELEASE);
+}
+
+/* Copies record `i` (head - nrecs <= i < head) into *out.
+ * Returns 1, or 0 if that slot is being (or was never completely) written. */
+static inline int hwm_flight_read(const hwm_flight_t *f, uint64_t i, hwm_flight_rec_t *out)
+{
+    const hwm_flight_rec_t *r = &f->recs[i & (f->nrecs - 1)];
+    uint64_t s1 = __atomic_load_n(&r->seq, __ATOMIC_ACQUIRE);
+    memcpy(out, (const void *)r, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t s2 = __atomic_load_n(&r->seq, __ATOMIC_RELAXED);
+    return s1 == i + 1 && s2 == s1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HIBRIWM_FLIGHT_H */
@@ -0,0 +1,68 @@
+/* hibriwm_layout.h
+ * Stable C ABI for native layout plugins (loaded with `layout-plugin <path.so>`).
+ *
+ * A plugin is a shared object exporting `hibriwm_layout_plugin`, which returns a static
+ * descriptor. On every relayout of a workspace using the plugin the WM calls `arrange`
+ * with an array of window descriptors and a caller-owned output array of the same length;
+ * the plugin writes one rectangle per window (same order) and returns 0. Any other return
+ * value makes the WM fall back to its built-in layout for that relayout.
+ *
+ * Rules for plugin authors:
+ *  - never keep pointers to `wins`, `area` or `out` after `arrange` returns;
+ *  - `cls` strings are NUL-terminated and only valid during the call;
+ *  - `arrange` runs on the WM main loop: do not block, do not call back into X.
+ * The ABI only ever grows by appending fields; HIBRIWM_LAYOUT_ABI is raised when it does.
+ * The WM loads plugins whose abi_version is in [HIBRIWM_LAYOUT_ABI_MIN, HIBRIWM_LAYOUT_ABI]
+ * and refuses anything else (0, garbage, or built against a newer ABI than its own).
+ *
+ * Build (example): cc -shared -fPIC mylayout.c -o mylayout.so
+ * The WM stats the file on every relayout and reloads it when its mtime changes;
+ * install new builds with an atomic rename (e.g. `install` or `mv`), not in place.
+ */
+#ifndef HIBRIWM_LAYOUT_H
+#define HIBRIWM_LAYOUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HIBRIWM_LAYOUT_ABI 1
+#define HIBRIWM_LAYOUT_ABI_MIN 1 /* oldest ABI still accepted */
+
+typedef struct hwm_rect {
+    int32_t x, y, w, h;
+} hwm_rect_t;
+
+enum {
+    HWM_WIN_FOCUSED = 1u << 0
+};
+
+typedef struct hwm_window {
+    uint32_t id;
+    uint32_t flags;                 /* HWM_WIN_* */
+    int32_t min_w, min_h;           /* WM_NORMAL_HINTS, 0 = unset */
+    int32_t max_w, max_h;
+    const char *cls;                /* WM_CLASS class, never NULL */
+} hwm_window_t;
+
+typedef struct hwm_layout_plugin {
+    uint32_t abi_version;           /* HIBRIWM_LAYOUT_ABI the plugin was built against */
+    const char *name;               /* layout name used by set-layout */
+    void *(*create)(void);          /* optional: per-load private state */
+    void (*destroy)(void *state);   /* optional: called before unload/reload */
+    int (*arrange)(void *state, int32_t workspace, const hwm_rect_t *area,
+                   const hwm_window_t *wins, size_t n, hwm_rect_t *out);
+} hwm_layout_plugin_t;
+
+/* The single exported entry point. */
+typedef const hwm_layout_plugin_t *(*hwm_layout_entry_fn)(void);
+#define HIBRIWM_LAYOUT_ENTRY "hibriwm_layout_plugin"
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HIBRIWM_LAYOUT_H */
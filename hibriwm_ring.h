@@ -0,0 +1,101 @@
+/* hibriwm_ring.h
+ * Shared-memory event ring: the WM is the single producer, any number of consumers read
+ * it concurrently, each with its own cursor.
+ *
+ * Send `event-ring` on the IPC socket: the reply line "event-ring" carries two fds
+ * (SCM_RIGHTS): a read-only memfd holding an hwm_ring_t, and an eventfd private to this
+ * consumer that is signalled after every batch of writes; "ERR ..." if there is no ring.
+ * Both start with "#<id> " for a tagged request. mmap the memfd PROT_READ, MAP_SHARED
+ * (its size is in `st_size`), start the cursor at hwm_ring_head() and call hwm_ring_next()
+ * until it returns 0, then block on the eventfd.
+ *
+ * Every event has a sequence number, the same "seq" the event carries on the socket
+ * (`subscribe`), so both streams can be correlated. A slot is reused after `nslots`
+ * events, so a consumer that falls that far behind loses events; hwm_ring_next() detects
+ * this from the slot sequence numbers and reports how many were lost instead of
+ * returning stale or torn data.
+ */
+#ifndef HIBRIWM_RING_H
+#define HIBRIWM_RING_H
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HIBRIWM_RING_MAGIC   0x48574d52u /* "HWMR" */
+#define HIBRIWM_RING_VERSION 1u
+#define HWM_RING_PAYLOAD     232
+
+enum hwm_event_type {
+    HWM_EV_OTHER = 0,
+    HWM_EV_WORKSPACE = 1,
+    HWM_EV_FOCUS = 2,
+    HWM_EV_BAR_TOGGLE = 3,
+    HWM_EV_LAYOUT = 4
+};
+
+enum {
+    HWM_SLOT_TRUNCATED = 1u << 0 /* payload did not fit and was cut at HWM_RING_PAYLOAD */
+};
+
+typedef struct hwm_ring_slot {
+    uint64_t seq;          /* event seq + 1 once written, 0 while being written */
+    uint64_t time_ns;      /* CLOCK_MONOTONIC */
+    uint16_t type;         /* enum hwm_event_type */
+    uint16_t flags;        /* HWM_SLOT_* */
+    uint16_t len;          /* payload bytes */
+    uint16_t reserved;
+    char data[HWM_RING_PAYLOAD]; /* JSON payload, not NUL-terminated */
+} hwm_ring_slot_t;         /* 256 bytes */
+
+typedef struct hwm_ring {
+    uint32_t magic;        /* HIBRIWM_RING_MAGIC */
+    uint32_t version;      /* HIBRIWM_RING_VERSION */
+    uint32_t nslots;       /* power of two */
+    uint32_t reserved;
+    uint64_t head;         /* seq of the next event to be written */
+    uint64_t pad[5];       /* keeps slots cache-line aligned */
+    hwm_ring_slot_t slots[];
+} hwm_ring_t;
+
+static inline uint64_t hwm_ring_head(const hwm_ring_t *r)
+{
+    return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}
+
+/* Reads the event at *cursor into *out.
+ * Returns 1 and advances *cursor on success, 0 if the consumer is caught up, or -1 if
+ * events were overwritten before they were read: *lost receives their count and *cursor
+ * jumps to the oldest event still in the ring. */
+static inline int hwm_ring_next(const hwm_ring_t *r, uint64_t *cursor, hwm_ring_slot_t *out, uint64_t *lost)
+{
+    uint64_t want = *cursor, head = hwm_ring_head(r);
+    if (want >= head) return 0;
+    if (head - want > r->nslots) {
+        *lost = head - r->nslots - want;
+        *cursor = head - r->nslots;
+        return -1;
+    }
+    const hwm_ring_slot_t *s = &r->slots[want & (r->nslots - 1)];
+    uint64_t s1 = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    memcpy(out, (const void *)s, sizeof(*out));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t s2 = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+    if (s1 != want + 1 || s2 != s1) { /* the producer lapped us while we copied */
+        head = hwm_ring_head(r);
+        *lost = head > r->nslots && head - r->nslots > want ? head - r->nslots - want : 1;
+        *cursor = want + *lost;
+        return -1;
+    }
+    *cursor = want + 1;
+    return 1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HIBRIWM_RING_H */
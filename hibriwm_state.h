@@ -0,0 +1,71 @@
+/* hibriwm_state.h
+ * Layout of the shared-memory state page published by the WM, plus a lock-free reader.
+ *
+ * Send `state-fd` on the IPC socket: the reply line "state-fd" carries a read-only memfd
+ * (SCM_RIGHTS), "ERR ..." if there is none; both start with "#<id> " for a tagged request.
+ * mmap it PROT_READ, MAP_SHARED with sizeof(hwm_state_page_t) and call hwm_state_read()
+ * whenever you want the current state: no syscalls, no parsing.
+ *
+ * The WM rewrites the page at most once per main-loop iteration and only when something
+ * changed, under a seqlock: `seq` is odd while an update is in progress and advances by 2
+ * per update, so a reader can also use it to tell whether anything changed since its
+ * last read.
+ */
+#ifndef HIBRIWM_STATE_H
+#define HIBRIWM_STATE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HIBRIWM_STATE_MAGIC   0x48574d53u /* "HWMS" */
+#define HIBRIWM_STATE_VERSION 1u
+#define HWM_MAX_MONITORS      8
+#define HWM_TITLE_MAX         256
+#define HWM_LAYOUT_NAME_MAX   16
+
+typedef struct hwm_monitor_state {
+    int32_t x, y, w, h;
+    int32_t current_ws;                 /* workspace shown on this monitor, 0 = none */
+    char layout[HWM_LAYOUT_NAME_MAX];   /* Layout::name() of that workspace, NUL-terminated */
+} hwm_monitor_state_t;
+
+typedef struct hwm_state {
+    uint32_t nmonitors;
+    int32_t focused_ws;                 /* workspace holding input focus */
+    uint64_t occupied;                  /* bit n set = workspace n has windows (n < 64) */
+    uint32_t focused_win;               /* X window id, 0 = none */
+    uint32_t bar_visible;
+    char title[HWM_TITLE_MAX];          /* focused window title, UTF-8, NUL-terminated */
+    hwm_monitor_state_t monitors[HWM_MAX_MONITORS];
+} hwm_state_t;
+
+typedef struct hwm_state_page {
+    uint32_t magic;                     /* HIBRIWM_STATE_MAGIC */
+    uint32_t version;                   /* HIBRIWM_STATE_VERSION */
+    uint64_t seq;                       /* seqlock counter, odd = write in progress */
+    hwm_state_t state;
+} hwm_state_page_t;
+
+/* Copies a consistent snapshot of the page into *out and returns its sequence number. */
+static inline uint64_t hwm_state_read(const hwm_state_page_t *page, hwm_state_t *out)
+{
+    uint64_t s1, s2;
+    do {
+        while ((s1 = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        memcpy(out, (const void *)&page->state, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        s2 = __atomic_load_n(&page->seq, __ATOMIC_RELAXED);
+    } while (s1 != s2);
+    return s1;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HIBRIWM_STATE_H */
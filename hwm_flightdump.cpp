@@ -0,0 +1,103 @@
+// hwm_flightdump.cpp - decodifica o flight recorder do MyWM (hibriwm_flight.h)
+//
+//   hwm_flightdump [arquivo]     imprime os registros, do mais antigo ao mais recente
+//
+// Arquivo padrão: ${XDG_RUNTIME_DIR:-/tmp}/hibriwm.flight (o da sessão atual, pode ser lido
+// com o WM rodando); depois de um crash e reinício, o da sessão anterior é hibriwm.flight.old.
+//
+// Build (example): g++ -O2 hwm_flightdump.cpp -o hwm_flightdump
+
+#include "hibriwm_flight.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+
+// nomes dos eventos do protocolo X (os do xcb-util, sem depender dele)
+static const char *x_event_name(uint64_t type) {
+    static const char *names[] = {
+        nullptr, nullptr, "KeyPress", "KeyRelease", "ButtonPress", "ButtonRelease", "MotionNotify",
+        "EnterNotify", "LeaveNotify", "FocusIn", "FocusOut", "KeymapNotify", "Expose", "GraphicsExposure",
+        "NoExposure", "VisibilityNotify", "CreateNotify", "DestroyNotify", "UnmapNotify", "MapNotify",
+        "MapRequest", "ReparentNotify", "ConfigureNotify", "ConfigureRequest", "GravityNotify",
+        "ResizeRequest", "CirculateNotify", "CirculateRequest", "PropertyNotify", "SelectionClear",
+        "SelectionRequest", "SelectionNotify", "ColormapNotify", "ClientMessage", "MappingNotify", "GenericEvent"};
+    return type < sizeof(names) / sizeof(names[0]) ? names[type] : nullptr;
+}
+
+static void print_rec(const hwm_flight_t *f, const hwm_flight_rec_t &r, uint64_t prev_ns) {
+    // hora de parede a partir do par de relógios gravado no cabeçalho
+    uint64_t real = f->real_ns + (r.time_ns - f->mono_ns);
+    time_t sec = (time_t)(real / 1000000000ull);
+    struct tm tm;
+    localtime_r(&sec, &tm);
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &tm);
+    double delta_ms = prev_ns ? (r.time_ns - prev_ns) / 1e6 : 0;
+    printf("%s.%06" PRIu64 " %+9.3fms xseq=%-8" PRIu32 " ", when, (uint64_t)(real % 1000000000ull / 1000), delta_ms, r.xseq);
+    std::string text(r.text, r.len);
+    switch (r.kind) {
+        case HWM_FL_START: printf("START    pid=%" PRIu64 " %s\n", r.a, text.c_str()); break;
+        case HWM_FL_EVENT: {
+            const char *name = x_event_name(r.a);
+            if (name) printf("EVENT    %-16s", name);
+            else printf("EVENT    type=%-11" PRIu64, r.a);
+            if (r.a == 2 || r.a == 4) printf(" code=%" PRIu64 " state=0x%" PRIx64 "\n", r.b & 0xff, r.b >> 8);
+            else if (r.b) printf(" win=0x%" PRIx64 "\n", r.b);
+            else printf("\n");
+            break;
+        }
+        case HWM_FL_COMMAND: {
+            static const char *classes[] = {"input", "config", "ipc"};
+            printf("COMMAND  [%s", r.b < 3 ? classes[r.b] : "?");
+            if (r.a) printf(" #%" PRIu64, r.a);
+            printf("] %s%s\n", text.c_str(), r.len == HWM_FLIGHT_TEXT ? "…" : "");
+            break;
+        }
+        case HWM_FL_LAYOUT: printf("LAYOUT   ws=%" PRIu64 " %s tiled=%" PRIu64 "\n", r.a, text.c_str(), r.b); break;
+        case HWM_FL_STALL: printf("STALL    %" PRIu64 "ms #%" PRIu64 " %s\n", r.a / 1000, r.b, text.c_str()); break;
+        case HWM_FL_NOTE: printf("NOTE     %s\n", text.c_str()); break;
+        default: printf("kind=%u a=%" PRIu64 " b=%" PRIu64 " %s\n", r.kind, r.a, r.b, text.c_str()); break;
+    }
+}
+
+int main(int argc, char **argv) {
+    std::string path;
+    if (argc > 1) path = argv[1];
+    else {
+        const char *dir = getenv("XDG_RUNTIME_DIR");
+        path = std::string(dir && *dir ? dir : "/tmp") + "/hibriwm.flight";
+    }
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) { fprintf(stderr, "hwm_flightdump: não foi possível abrir %s\n", path.c_str()); return 2; }
+    if ((size_t)st.st_size < sizeof(hwm_flight_t)) { fprintf(stderr, "hwm_flightdump: %s: arquivo curto demais\n", path.c_str()); return 1; }
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) { perror("hwm_flightdump: mmap"); return 2; }
+    const hwm_flight_t *f = (const hwm_flight_t *)map;
+    if (f->magic != HIBRIWM_FLIGHT_MAGIC || f->version != HIBRIWM_FLIGHT_VERSION || !f->nrecs
+        || (f->nrecs & (f->nrecs - 1))
+        || (size_t)st.st_size < sizeof(hwm_flight_t) + (size_t)f->nrecs * sizeof(hwm_flight_rec_t)) {
+        fprintf(stderr, "hwm_flightdump: %s não é um flight recorder do MyWM (ou é de outra versão)\n", path.c_str());
+        return 1;
+    }
+    uint64_t head = __atomic_load_n(&f->head, __ATOMIC_ACQUIRE);
+    uint64_t first = head > f->nrecs ? head - f->nrecs : 0;
+    printf("# %s: pid %u, %" PRIu64 " registros (%" PRIu64 " no arquivo)\n", path.c_str(), f->pid, head, head - first);
+    uint64_t prev_ns = 0, missing = 0;
+    for (uint64_t i = first; i < head; i++) {
+        hwm_flight_rec_t r;
+        if (!hwm_flight_read(f, i, &r)) { missing++; continue; } // escrita interrompida (ou em andamento)
+        print_rec(f, r, prev_ns);
+        prev_ns = r.time_ns;
+    }
+    if (missing) printf("# %" PRIu64 " registro(s) incompleto(s) ignorado(s)\n", missing);
+    return 0;
+}
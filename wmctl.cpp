@@ -0,0 +1,71 @@
+// wmctl.cpp - cliente de IPC para MyWM (uma conexão persistente, sem socat)
+//
+//   wmctl <comando> [args...]       envia um comando; imprime a resposta se não for "OK"
+//   wmctl -                         lê um comando por linha do stdin, todos na mesma conexão,
+//                                   em pipeline (não espera cada resposta antes de mandar a próxima)
+//   wmctl subscribe [args...]       imprime o fluxo de eventos (ex.: subscribe format=lemonbar)
+//
+// Saída: 0 se todos os comandos responderam OK (ou dados), 1 se algum respondeu ERR,
+// 2 se o WM não está acessível.
+//
+// Build (example): g++ -O2 wmctl.cpp hibriwm_client.cpp -o wmctl
+
+#include "hibriwm_client.h"
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+static bool is_error(const std::string &reply) { return reply.compare(0, 3, "ERR") == 0; }
+
+static int run_stdin(HwmClient &c) {
+    int status = 0;
+    std::string line;
+    uint64_t lineno = 0;
+    while (std::getline(std::cin, line)) {
+        lineno++;
+        if (line.empty() || line[0] == '#') continue; // linhas vazias e comentários
+        c.send(line, [&status, lineno, line](uint64_t, const std::string &reply) {
+            if (is_error(reply)) { std::cerr << "wmctl: linha " << lineno << " (" << line << "): " << reply << "\n"; status = 1; }
+            else if (reply != "OK") std::cout << reply << "\n";
+        });
+        // lê as respostas já disponíveis sem esperar: mantém o pipeline cheio
+        if (c.pending() > 256 && (!c.flush() || c.poll_replies(0) < 0)) return 2;
+    }
+    if (!c.drain()) return 2;
+    return status;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        std::cerr << "Uso: wmctl <comando> [args...] | wmctl - | wmctl subscribe [args...]\n";
+        return 1;
+    }
+    std::ios::sync_with_stdio(false);
+    std::string sock = hwm_socket_path();
+    HwmClient c;
+    if (!c.connect(sock)) {
+        std::cerr << "wmctl: WM socket não encontrado em " << sock << "\n";
+        return 2;
+    }
+    std::string first = argv[1];
+    if (first == "-" && argc == 2) return run_stdin(c);
+
+    std::string args;
+    for (int i = (first == "subscribe" ? 2 : 1); i < argc; i++) {
+        if (!args.empty()) args += ' ';
+        args += argv[i];
+    }
+    if (first == "subscribe") {
+        bool ok = c.subscribe(args, [](const std::string &line) {
+            std::cout << line << '\n' << std::flush; // pipes (lemonbar, jq) querem cada linha na hora
+            return bool(std::cout);
+        });
+        return ok ? 0 : 2;
+    }
+    auto reply = c.command(args);
+    if (!reply) { std::cerr << "wmctl: conexão com o WM perdida\n"; return 2; }
+    if (is_error(*reply)) { std::cerr << "wmctl: " << *reply << "\n"; return 1; }
+    if (*reply != "OK") std::cout << *reply << "\n";
+    return 0;
+}
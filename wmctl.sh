@@ -1,16 +1,16 @@
 #!/bin/sh
-# wmctl - cliente simples de IPC para MyWM
+# wmctl.sh - cliente de IPC para MyWM em shell (referência; o wmctl nativo é o wmctl.cpp)
 # Usa socat para mandar comandos para o socket UNIX do WM
 
 SOCK="${XDG_RUNTIME_DIR:-/tmp}/mywm.sock"
 
 if [ ! -S "$SOCK" ]; then
-  echo "wmctl: WM socket não encontrado em $SOCK" >&2
+  echo "wmctl.sh: WM socket não encontrado em $SOCK" >&2
   exit 1
 fi
 
 if [ $# -eq 0 ]; then
-  echo "Uso: wmctl <comando> [args...]"
+  echo "Uso: wmctl.sh <comando> [args...]"
   exit 1
 fi
 